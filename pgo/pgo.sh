@@ -0,0 +1,123 @@
+#!/bin/sh
+#
+# Training run and report of the profile-guided build. Called by "make release-pgo".
+#
+#   pgo/pgo.sh train <binary>
+#       Runs the instrumented binary on the decoder benchmark and on the recorded workload.
+#   pgo/pgo.sh report <baseline> <optimized> <report file>
+#       Compares the decoding throughput and the scan latency of two binaries.
+#
+# Scans are typed on a private Xvfb server. Training fails without it: scans would only be queued, and the
+# typing path, never run, would be optimized as cold code. The report only skips the latency.
+#
+# A single benchmark run swings by a fifth or more, so throughput is the median of RUNS runs of each binary,
+# taken in turns so that both see the same load.
+
+PGO_DIR=$(dirname "$0")
+WORKLOAD="$PGO_DIR/workload.txt"
+REPLAY=${REPLAY:-bin/replay}
+INTERVAL=${INTERVAL:-20}
+RUNS=${RUNS:-5}
+XVFB_DISPLAY=${XVFB_DISPLAY:-:97}
+XVFB_PID=
+
+startXvfb()
+{
+    if ! command -v Xvfb > /dev/null
+    then
+        echo "Xvfb not found." >&2
+        return 1
+    fi
+
+    Xvfb "$XVFB_DISPLAY" -nolisten tcp > /dev/null 2>&1 &
+    XVFB_PID=$!
+    trap 'kill $XVFB_PID 2> /dev/null' EXIT
+
+    # Wait for the server to accept connections.
+    for i in 1 2 3 4 5 6 7 8 9 10
+    do
+        [ -S "/tmp/.X11-unix/X${XVFB_DISPLAY#:}" ] && return 0
+        sleep 0.5
+    done
+
+    echo "Xvfb did not start on $XVFB_DISPLAY." >&2
+    return 1
+}
+
+# Replay the workload on a binary, printing its seat statistics line.
+replay()
+{
+    "$REPLAY" "$WORKLOAD" "$INTERVAL" "$1" --seat "@PTY@=$XVFB_DISPLAY" --terminator ENTER --pacing --loglevel 4 \
+        | grep "=>"
+}
+
+# Print "<protocol> <frames/s>" for every protocol.
+benchmark()
+{
+    "$1" --benchmark | awk 'NR > 1 { print $1, $3 }'
+}
+
+# Print "<protocol> <median> <spread>" for every protocol of a file of benchmark lines, the spread being
+# the difference between the fastest and the slowest run in percent of the median.
+median()
+{
+    sort -k1,1 -k2,2n "$1" | awk '
+        function flush() { if(n) printf "%s %d %.1f\n", protocol, runs[int((n + 1) / 2)], (runs[n] - runs[1]) * 100 / runs[int((n + 1) / 2)] }
+        $1 != protocol { flush(); protocol = $1; n = 0 }
+        { runs[++n] = $2 }
+        END { flush() }'
+}
+
+case "$1" in
+    train)
+        if ! startXvfb
+        then
+            echo "Cannot train the profile-guided build without Xvfb: install it and run make release-pgo again." >&2
+            exit 1
+        fi
+
+        benchmark "$2" > /dev/null
+        replay "$2"
+        ;;
+
+    report)
+        startXvfb && LATENCY=yes
+
+        : > /tmp/pgo-baseline.$$
+        : > /tmp/pgo-optimized.$$
+
+        for run in $(seq "$RUNS")
+        do
+            benchmark "$2" >> /tmp/pgo-baseline.$$
+            benchmark "$3" >> /tmp/pgo-optimized.$$
+        done
+
+        {
+            echo "Profile-guided build report ($(date '+%Y-%m-%d %H:%M'), $(uname -m))"
+            echo
+            echo "Decoding throughput (frames/s, --benchmark, median of $RUNS runs; spread is the widest of the two):"
+            median /tmp/pgo-baseline.$$ > /tmp/pgo-baseline-median.$$
+            median /tmp/pgo-optimized.$$ > /tmp/pgo-optimized-median.$$
+            join /tmp/pgo-baseline-median.$$ /tmp/pgo-optimized-median.$$ | awk -v baseline="$(basename "$2")" -v optimized="$(basename "$3")" '
+                BEGIN { printf "    %-8s %14s %14s %8s %8s\n", "Protocol", baseline, optimized, "Change", "Spread" }
+                { printf "    %-8s %14d %14d %+7.1f%% %7.1f%%\n", $1, $2, $4, ($4 - $2) * 100 / $2, ($3 > $5) ? $3 : $5 }'
+            echo
+            echo "Scan latency (end of frame to last keystroke, $(grep -vc '^#' "$WORKLOAD") reads of $WORKLOAD every $INTERVAL ms):"
+
+            if [ -n "$LATENCY" ]
+            then
+                printf "    %-12s: %s\n" "$(basename "$2")" "$(replay "$2" | sed 's/.*: //')"
+                printf "    %-12s: %s\n" "$(basename "$3")" "$(replay "$3" | sed 's/.*: //')"
+            else
+                echo "    Skipped: Xvfb is not available."
+            fi
+        } | tee "$4"
+
+        rm -f /tmp/pgo-baseline.$$ /tmp/pgo-optimized.$$ /tmp/pgo-baseline-median.$$ /tmp/pgo-optimized-median.$$
+        ;;
+
+    *)
+        echo "Usage: $0 train <binary> | report <baseline> <optimized> <report file>" >&2
+        exit 2
+        ;;
+esac
@@ -0,0 +1,191 @@
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ *  Replays a recorded scanner workload through a pseudo-terminal, as if the scanner was plugged in.
+ *
+ *  Usage: replay <recording> <interval ms> <command> [arguments...]
+ *
+ *  The command is started with every "@PTY@" in its arguments replaced by the path of the terminal.
+ *  Every line of the recording is the content of one read from the scanner, with C escapes ("\x02",
+ *  "\r", "\\"...) for the bytes that are not printable. Empty lines and lines starting with '#' are
+ *  skipped. Lines are written one every <interval> milliseconds, then the command is given one second
+ *  to type what it received and terminated with SIGTERM. The exit status is the one of the command.
+ */
+
+#define REPLAY_MAX_LINE 4096
+#define REPLAY_STARTUP 500
+#define REPLAY_DRAIN 1000
+
+int unescape(char *line, unsigned char *bytes);
+void sleepMilliseconds(long milliseconds);
+
+int main(int argc, char **argv)
+{
+    if(argc < 4)
+    {
+        fprintf(stderr, "Usage: %s <recording> <interval ms> <command> [arguments...]\n", argv[0]);
+        return 2;
+    }
+
+    FILE *recording = fopen(argv[1], "r");
+    long interval = atol(argv[2]);
+
+    if(recording == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+        return 2;
+    }
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if(master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+    {
+        fprintf(stderr, "Failed to open a pseudo-terminal: %s\n", strerror(errno));
+        return 2;
+    }
+
+    char *path = strdup(ptsname(master));
+
+    // Keep the terminal open (and raw) on our side too, so that nothing is lost before the command opens it.
+    int slave = open(path, O_RDWR | O_NOCTTY);
+    struct termios tty;
+
+    if(slave == -1 || tcgetattr(slave, &tty) == -1)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+
+    cfmakeraw(&tty);
+    tcsetattr(slave, TCSANOW, &tty);
+
+    // Build the command line of the command.
+    char **arguments = calloc(argc - 2, sizeof(char *));
+
+    for(int i = 3; i < argc; ++i)
+    {
+        char *placeholder = strstr(argv[i], "@PTY@");
+
+        if(placeholder == NULL)
+        {
+            arguments[i - 3] = argv[i];
+            continue;
+        }
+
+        arguments[i - 3] = malloc(strlen(argv[i]) + strlen(path) + 1);
+        sprintf(arguments[i - 3], "%.*s%s%s", (int) (placeholder - argv[i]), argv[i], path, placeholder + 5);
+    }
+
+    pid_t child = fork();
+
+    if(child == -1)
+    {
+        fprintf(stderr, "Failed to start %s: %s\n", arguments[0], strerror(errno));
+        return 2;
+    }
+
+    if(child == 0)
+    {
+        close(master);
+        close(slave);
+        execvp(arguments[0], arguments);
+        fprintf(stderr, "Failed to start %s: %s\n", arguments[0], strerror(errno));
+        _exit(127);
+    }
+
+    sleepMilliseconds(REPLAY_STARTUP);
+
+    char line[REPLAY_MAX_LINE];
+    unsigned char bytes[REPLAY_MAX_LINE];
+    int reads = 0;
+
+    while(fgets(line, sizeof line, recording) != NULL)
+    {
+        line[strcspn(line, "\n")] = 0;
+
+        if(line[0] == 0 || line[0] == '#')
+            continue;
+
+        int length = unescape(line, bytes);
+
+        if(write(master, bytes, length) != length)
+        {
+            fprintf(stderr, "Failed to write to %s: %s\n", path, strerror(errno));
+            break;
+        }
+
+        reads++;
+        sleepMilliseconds(interval);
+    }
+
+    fclose(recording);
+    fprintf(stderr, "Replayed %d reads on %s.\n", reads, path);
+
+    sleepMilliseconds(REPLAY_DRAIN);
+    kill(child, SIGTERM);
+
+    int status;
+
+    if(waitpid(child, &status, 0) == -1 || !WIFEXITED(status))
+        return 1;
+
+    return WEXITSTATUS(status);
+}
+
+// Decode the C escapes of a line of the recording. Returns the number of bytes.
+int unescape(char *line, unsigned char *bytes)
+{
+    int length = 0;
+
+    for(char *c = line; *c != 0; ++c)
+    {
+        if(*c != '\\' || c[1] == 0)
+        {
+            bytes[length++] = *c;
+            continue;
+        }
+
+        switch(*++c)
+        {
+            case 'x':
+                if(c[1] == 0 || c[2] == 0)
+                    return length;
+
+                bytes[length++] = strtol((char[]) { c[1], c[2], 0 }, NULL, 16);
+                c += 2;
+                break;
+            case 'r':
+                bytes[length++] = '\r';
+                break;
+            case 'n':
+                bytes[length++] = '\n';
+                break;
+            case 't':
+                bytes[length++] = '\t';
+                break;
+            default:
+                bytes[length++] = *c;
+        }
+    }
+
+    return length;
+}
+
+void sleepMilliseconds(long milliseconds)
+{
+    struct timespec delay = { milliseconds / 1000, (milliseconds % 1000) * 1000000 };
+
+    while(nanosleep(&delay, &delay) == -1 && errno == EINTR);
+}
@@ -0,0 +1,388 @@
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "common.h"
+#include "batch.h"
+
+// Buckets of an empty batch: the table doubles whenever it holds as many entries as buckets.
+#define BATCH_INITIAL_BUCKETS 64
+
+// Seconds a socket reader has to accept a batch before it is reported as not submitted.
+#define BATCH_SOCKET_TIMEOUT 1
+
+typedef struct
+{
+    char *text;
+    int length;
+    int capacity;
+    int failed;
+} TextBuffer;
+
+unsigned int hashBarcode(const char *barcode);
+int growBuckets(Batch *batch);
+void appendText(TextBuffer *buffer, const char *format, ...);
+void appendBarcode(TextBuffer *buffer, const char *barcode, int format);
+int writeAll(int fd, const char *text, int length);
+
+char *formatNames[] = { "tsv", "csv", "ndjson" };
+int formatCount = sizeof(formatNames) / sizeof(formatNames[0]);
+
+/*
+ *  IMPORTANT NOTICE
+ *
+ *  A batch belongs to the thread of its seat: nothing here is thread safe. Several seats can append to the
+ *  same file, as every batch is written with a single write() on a descriptor opened in append mode, so
+ *  batches never interleave.
+ */
+
+// Count a scan. Returns the number of times the barcode has been scanned, FAILED if it could not be stored.
+int batchAdd(Batch *batch, const char *barcode)
+{
+    if(batch->count >= batch->bucketCount && growBuckets(batch) == FAILED)
+        return FAILED;
+
+    unsigned int bucket = hashBarcode(barcode) % batch->bucketCount;
+
+    for(int i = batch->buckets[bucket]; i != FAILED; i = batch->entries[i].next)
+        if(strcmp(batch->entries[i].barcode, barcode) == 0)
+        {
+            batch->scans++;
+            return ++batch->entries[i].count;
+        }
+
+    if(batch->count == batch->capacity)
+    {
+        int capacity = batch->capacity * 2;
+        BatchEntry *entries = realloc(batch->entries, capacity * sizeof(BatchEntry));
+
+        if(entries == NULL)
+            return FAILED;
+
+        batch->entries = entries;
+        batch->capacity = capacity;
+    }
+
+    BatchEntry *entry = &batch->entries[batch->count];
+
+    if((entry->barcode = strdup(barcode)) == NULL)
+        return FAILED;
+
+    entry->count = 1;
+    entry->next = batch->buckets[bucket];
+    batch->buckets[bucket] = batch->count++;
+    batch->scans++;
+
+    return 1;
+}
+
+// FNV-1a
+unsigned int hashBarcode(const char *barcode)
+{
+    uint32_t hash = 2166136261u;
+
+    for(const unsigned char *c = (const unsigned char *) barcode; *c != 0; ++c)
+        hash = (hash ^ *c) * 16777619u;
+
+    return hash;
+}
+
+// Double the hash table (or allocate the first one) and the entries with it.
+int growBuckets(Batch *batch)
+{
+    int bucketCount = batch->bucketCount ? batch->bucketCount * 2 : BATCH_INITIAL_BUCKETS;
+    int *buckets = malloc(bucketCount * sizeof(int));
+
+    if(buckets == NULL)
+        return FAILED;
+
+    if(batch->entries == NULL)
+    {
+        if((batch->entries = malloc(bucketCount * sizeof(BatchEntry))) == NULL)
+        {
+            free(buckets);
+            return FAILED;
+        }
+
+        batch->capacity = bucketCount;
+    }
+
+    for(int i = 0; i < bucketCount; ++i)
+        buckets[i] = FAILED;
+
+    for(int i = 0; i < batch->count; ++i)
+    {
+        unsigned int bucket = hashBarcode(batch->entries[i].barcode) % bucketCount;
+
+        batch->entries[i].next = buckets[bucket];
+        buckets[bucket] = i;
+    }
+
+    free(batch->buckets);
+    batch->buckets = buckets;
+    batch->bucketCount = bucketCount;
+    return OK;
+}
+
+// Format the batch, one line per distinct barcode. Typed blocks (BATCH_TSV) have no final newline: the
+// terminator follows the last line. Returns a malloc'd string, NULL if out of memory.
+char *batchFormat(Batch *batch, int format, const char *seat)
+{
+    TextBuffer buffer = { NULL, 0, 0, FALSE };
+    char now[32];
+    time_t seconds = time(NULL);
+    struct tm local;
+
+    strftime(now, sizeof now, "%Y-%m-%dT%H:%M:%S%z", localtime_r(&seconds, &local));
+    appendText(&buffer, "");
+
+    for(int i = 0; i < batch->count; ++i)
+    {
+        BatchEntry *entry = &batch->entries[i];
+
+        switch(format)
+        {
+            case BATCH_CSV:
+                appendBarcode(&buffer, entry->barcode, format);
+                appendText(&buffer, ",%lu,", entry->count);
+                appendBarcode(&buffer, seat, format);
+                appendText(&buffer, ",%s\n", now);
+                break;
+            case BATCH_NDJSON:
+                appendText(&buffer, "{\"barcode\": ");
+                appendBarcode(&buffer, entry->barcode, format);
+                appendText(&buffer, ", \"count\": %lu, \"seat\": ", entry->count);
+                appendBarcode(&buffer, seat, format);
+                appendText(&buffer, ", \"time\": \"%s\"}\n", now);
+                break;
+            case BATCH_TSV:
+            default:
+                appendBarcode(&buffer, entry->barcode, format);
+                appendText(&buffer, (i + 1 < batch->count) ? "\t%lu\n" : "\t%lu", entry->count);
+        }
+    }
+
+    if(buffer.failed)
+    {
+        free(buffer.text);
+        return NULL;
+    }
+
+    return buffer.text;
+}
+
+void appendText(TextBuffer *buffer, const char *format, ...)
+{
+    va_list arguments;
+
+    va_start(arguments, format);
+    int length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+
+    if(buffer->failed || length < 0)
+    {
+        buffer->failed = TRUE;
+        return;
+    }
+
+    if(buffer->length + length + 1 > buffer->capacity)
+    {
+        int capacity = (buffer->capacity > 0) ? buffer->capacity : 256;
+
+        while(buffer->length + length + 1 > capacity)
+            capacity *= 2;
+
+        char *text = realloc(buffer->text, capacity);
+
+        if(text == NULL)
+        {
+            buffer->failed = TRUE;
+            return;
+        }
+
+        buffer->text = text;
+        buffer->capacity = capacity;
+    }
+
+    va_start(arguments, format);
+    vsnprintf(buffer->text + buffer->length, length + 1, format, arguments);
+    va_end(arguments);
+
+    buffer->length += length;
+}
+
+// Append a barcode, quoted or escaped as the format requires.
+void appendBarcode(TextBuffer *buffer, const char *barcode, int format)
+{
+    if(format == BATCH_CSV)
+    {
+        if(strpbrk(barcode, ",\"\r\n") == NULL)
+        {
+            appendText(buffer, "%s", barcode);
+            return;
+        }
+
+        appendText(buffer, "\"");
+
+        for(const char *c = barcode; *c != 0; ++c)
+            appendText(buffer, (*c == '"') ? "\"\"" : "%c", *c);
+
+        appendText(buffer, "\"");
+    }
+    else if(format == BATCH_NDJSON)
+    {
+        appendText(buffer, "\"");
+
+        for(const unsigned char *c = (const unsigned char *) barcode; *c != 0; ++c)
+        {
+            if(*c == '"' || *c == '\\')
+                appendText(buffer, "\\%c", *c);
+            else if(*c < 0x20)
+                appendText(buffer, "\\u%04x", *c);
+            else
+                appendText(buffer, "%c", *c);
+        }
+
+        appendText(buffer, "\"");
+    }
+    else
+    {
+        // Tabs and newlines would be typed as Tab and Return: they would break the rows.
+        for(const char *c = barcode; *c != 0; ++c)
+            appendText(buffer, "%c", (*c == '\t' || *c == '\n') ? ' ' : *c);
+    }
+}
+
+// Send a formatted batch to a file or a socket.
+int batchWrite(int output, const char *path, const char *text)
+{
+    int length = strlen(text);
+    int fd;
+
+    if(output == BATCH_FILE)
+    {
+        if((fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == FAILED)
+        {
+            LOG(LOG_ERROR, "  Failed to open %s: %s", path, strerror(errno));
+            return FAILED;
+        }
+    }
+    else
+    {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        struct timeval timeout = { BATCH_SOCKET_TIMEOUT, 0 };
+
+        snprintf(address.sun_path, sizeof address.sun_path, "%s", path);
+
+        if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == FAILED)
+        {
+            LOG(LOG_ERROR, "  Failed to create a socket: %s", strerror(errno));
+            return FAILED;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+        if(connect(fd, (struct sockaddr *) &address, sizeof address) == FAILED)
+        {
+            LOG(LOG_ERROR, "  Failed to connect to %s: %s", path, strerror(errno));
+            close(fd);
+            return FAILED;
+        }
+    }
+
+    int result = writeAll(fd, text, length);
+
+    if(result == FAILED)
+        LOG(LOG_ERROR, "  Failed to write to %s: %s", path, strerror(errno));
+
+    close(fd);
+    return result;
+}
+
+int writeAll(int fd, const char *text, int length)
+{
+    while(length > 0)
+    {
+        int written = send(fd, text, length, MSG_NOSIGNAL);
+
+        // Not a socket: files are written with a single write, which O_APPEND keeps in one piece.
+        if(written == FAILED && errno == ENOTSOCK)
+            written = write(fd, text, length);
+
+        if(written == FAILED && errno == EINTR)
+            continue;
+
+        if(written <= 0)
+            return FAILED;
+
+        text += written;
+        length -= written;
+    }
+
+    return OK;
+}
+
+// Returns the format named, FAILED if there is none.
+int batchParseFormat(const char *name)
+{
+    for(int i = 0; i < formatCount; ++i)
+        if(strcasecmp(name, formatNames[i]) == 0)
+            return i;
+
+    return FAILED;
+}
+
+// Parse "type", "file:<path>" or "socket:<path>". Returns the output, FAILED if invalid.
+int batchParseOutput(const char *description, char *path, int size)
+{
+    const char *separator = strchr(description, ':');
+    int output = FAILED;
+
+    path[0] = 0;
+
+    if(strcasecmp(description, "type") == 0)
+        return BATCH_TYPE;
+
+    if(separator == NULL || separator[1] == 0 || strlen(separator + 1) >= size)
+        return FAILED;
+
+    if(separator - description == 4 && strncasecmp(description, "file", 4) == 0)
+        output = BATCH_FILE;
+    else if(separator - description == 6 && strncasecmp(description, "socket", 6) == 0)
+        output = BATCH_SOCKET;
+
+    // Socket paths are limited by struct sockaddr_un.
+    if(output == BATCH_SOCKET && strlen(separator + 1) >= sizeof(((struct sockaddr_un *) NULL)->sun_path))
+        return FAILED;
+
+    if(output != FAILED)
+        strcpy(path, separator + 1);
+
+    return output;
+}
+
+// Forget the barcodes of the batch, keeping the memory for the next session.
+void batchClear(Batch *batch)
+{
+    for(int i = 0; i < batch->count; ++i)
+        free(batch->entries[i].barcode);
+
+    for(int i = 0; i < batch->bucketCount; ++i)
+        batch->buckets[i] = FAILED;
+
+    batch->count = 0;
+    batch->scans = 0;
+}
+
+void batchTerminate(Batch *batch)
+{
+    batchClear(batch);
+    free(batch->entries);
+    free(batch->buckets);
+    memset(batch, 0, sizeof *batch);
+}
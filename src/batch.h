@@ -0,0 +1,43 @@
+#pragma once
+
+// Distinct barcodes a session collects before it is submitted on its own.
+#define BATCH_MAX_ENTRIES 4096
+
+// How a batch is formatted...
+#define BATCH_TSV       0       // "<barcode>\t<count>" lines, typed as a spreadsheet paste
+#define BATCH_CSV       1       // "<barcode>,<count>,<seat>,<time>" lines
+#define BATCH_NDJSON    2       // {"barcode": ..., "count": ..., "seat": ..., "time": ...} lines
+
+// ...and where it goes.
+#define BATCH_TYPE      0       // Typed into the display of the seat in one go
+#define BATCH_FILE      1       // Appended to a file
+#define BATCH_SOCKET    2       // Sent to a unix stream socket, one connection per batch
+
+typedef struct
+{
+    char *barcode;
+    unsigned long count;
+    int next;                   // Next entry in the same bucket (FAILED if last)
+} BatchEntry;
+
+// Barcodes collected during an intake session, each with the number of times it was scanned,
+// in the order they were first scanned.
+typedef struct
+{
+    BatchEntry *entries;
+    int count;
+    int capacity;
+
+    int *buckets;               // First entry of every hash bucket (FAILED if empty)
+    int bucketCount;
+
+    unsigned long scans;        // Including duplicates
+} Batch;
+
+int batchAdd(Batch *batch, const char *barcode);
+char *batchFormat(Batch *batch, int format, const char *seat);
+int batchWrite(int output, const char *path, const char *text);
+int batchParseFormat(const char *name);
+int batchParseOutput(const char *description, char *path, int size);
+void batchClear(Batch *batch);
+void batchTerminate(Batch *batch);
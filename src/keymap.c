@@ -0,0 +1,322 @@
+#include <X11/Xlib.h>
+
+#include "common.h"
+#include "keymap.h"
+
+int readMapping(Keymap *keymap, Display *display);
+void chooseSpares(Keymap *keymap);
+void indexMapping(Keymap *keymap);
+int isEmpty(Keymap *keymap, int keycode);
+int isSpare(Keymap *keymap, int keycode);
+int findKeycode(Keymap *keymap, KeySym symbol, KeyCode *keycode, unsigned int *state);
+int changeMapping(Keymap *keymap, Display *display, int first, int last);
+
+/*
+ *  IMPORTANT NOTICE
+ *
+ *  The spares are a single run of adjacent keycodes without any keysym, so that the one XChangeKeyboardMapping
+ *  call of a scan, which covers every keycode from the first to the last one it binds, never rewrites a key of
+ *  the keyboard: under XKB that would reset the groups and levels the core mapping cannot express (AltGr...).
+ *  The run is looked for from the highest keycode down, where evdev leaves room.
+ *
+ *  The mapping belongs to the server: other clients can change it at any time (setxkbmap, a layout switch...).
+ *  Every MappingNotify makes us read it again (see keymapRefresh), so that what we send back for the spares
+ *  is never older than the last change.
+ */
+
+// Fetch the keyboard mapping once, index the Latin-1 keysyms and collect the keycodes that have no keysym
+// at all: those can be bound to any keysym missing from the keyboard without disturbing the user.
+int keymapInitialize(Keymap *keymap, Display *display)
+{
+    if(keymap->initialized)
+        keymapTerminate(keymap, display);
+
+    XDisplayKeycodes(display, &keymap->minimumKeycode, &keymap->maximumKeycode);
+
+    if(readMapping(keymap, display) == FAILED)
+        return FAILED;
+
+    chooseSpares(keymap);
+    indexMapping(keymap);
+
+    if(keymap->spareCount > 0)
+        LOG(LOG_DEBUG, "  Keyboard mapping read: keycodes %d to %d, %d spare (%d to %d).", keymap->minimumKeycode, keymap->maximumKeycode,
+            keymap->spareCount, keymap->spares[0].keycode, keymap->spares[keymap->spareCount - 1].keycode);
+    else
+        LOG(LOG_WARNING, "  No spare keycode: characters missing from the keyboard will not be typed.");
+
+    keymap->initialized = TRUE;
+    return OK;
+}
+
+int readMapping(Keymap *keymap, Display *display)
+{
+    keymap->mapping = XGetKeyboardMapping(display, keymap->minimumKeycode, keymap->maximumKeycode - keymap->minimumKeycode + 1, &keymap->keysymsPerKeycode);
+
+    if(keymap->mapping == NULL)
+    {
+        LOG(LOG_ERROR, "  Failed to read the keyboard mapping.");
+        return FAILED;
+    }
+
+    return OK;
+}
+
+// Take the longest run of empty keycodes (at most KEYMAP_MAX_SPARE), the highest one if several are as long.
+void chooseSpares(Keymap *keymap)
+{
+    int first = 0;
+    int longest = 0;
+    int length = 0;
+
+    for(int keycode = keymap->maximumKeycode; keycode >= keymap->minimumKeycode && longest < KEYMAP_MAX_SPARE; --keycode)
+    {
+        length = isEmpty(keymap, keycode) ? length + 1 : 0;
+
+        if(length > longest)
+        {
+            longest = length;
+            first = keycode;
+        }
+    }
+
+    for(int i = 0; i < longest; ++i)
+    {
+        keymap->spares[i].keycode = first + i;
+        keymap->spares[i].symbol = NoSymbol;
+        keymap->spares[i].lastUsed = 0;
+    }
+
+    keymap->spareCount = longest;
+}
+
+// Find the keycode typing every Latin-1 keysym. Spares are left out: their binding only lasts a few scans.
+void indexMapping(Keymap *keymap)
+{
+    memset(keymap->latinKeycodes, 0, sizeof keymap->latinKeycodes);
+
+    for(int keycode = keymap->minimumKeycode; keycode <= keymap->maximumKeycode; ++keycode)
+    {
+        KeySym *symbols = &keymap->mapping[(keycode - keymap->minimumKeycode) * keymap->keysymsPerKeycode];
+
+        if(isSpare(keymap, keycode))
+            continue;
+
+        // Only the first two levels (plain and shifted) can be reached with the core modifiers alone.
+        for(int level = 0; level < 2 && level < keymap->keysymsPerKeycode; ++level)
+            if(symbols[level] != NoSymbol && symbols[level] < 256 && keymap->latinKeycodes[symbols[level]] == 0)
+            {
+                keymap->latinKeycodes[symbols[level]] = keycode;
+                keymap->latinStates[symbols[level]] = level ? ShiftMask : 0;
+            }
+    }
+}
+
+int isEmpty(Keymap *keymap, int keycode)
+{
+    KeySym *symbols = &keymap->mapping[(keycode - keymap->minimumKeycode) * keymap->keysymsPerKeycode];
+
+    for(int level = 0; level < keymap->keysymsPerKeycode; ++level)
+        if(symbols[level] != NoSymbol)
+            return FALSE;
+
+    return TRUE;
+}
+
+int isSpare(Keymap *keymap, int keycode)
+{
+    for(int i = 0; i < keymap->spareCount; ++i)
+        if(keymap->spares[i].keycode == keycode)
+            return TRUE;
+
+    return FALSE;
+}
+
+// Read the mapping again after a MappingNotify, which our own changes cause too. Spares bound by another
+// client in the meantime are given up; the others keep their binding.
+int keymapRefresh(Keymap *keymap, Display *display)
+{
+    if(!keymap->initialized)
+        return OK;
+
+    XFree(keymap->mapping);
+
+    if(readMapping(keymap, display) == FAILED)
+    {
+        keymap->initialized = FALSE;
+        return FAILED;
+    }
+
+    for(int i = 0; i < keymap->spareCount; )
+    {
+        SpareKeycode *spare = &keymap->spares[i];
+        int ours;
+
+        if(spare->symbol == NoSymbol)
+            ours = isEmpty(keymap, spare->keycode);
+        else
+            ours = keymap->mapping[(spare->keycode - keymap->minimumKeycode) * keymap->keysymsPerKeycode] == spare->symbol;
+
+        if(ours)
+        {
+            ++i;
+            continue;
+        }
+
+        LOG(LOG_WARNING, "  Spare keycode %d has been bound by another client: giving it up.", spare->keycode);
+        *spare = keymap->spares[--keymap->spareCount];
+    }
+
+    indexMapping(keymap);
+
+    LOG(LOG_DEBUG, "  Keyboard mapping read again: %d spare keycodes left.", keymap->spareCount);
+    return OK;
+}
+
+// Find keycodes and modifiers typing the given keysyms. Keysyms missing from the keyboard are bound to
+// spare keycodes, all with a single mapping change. Keycodes bound by previous scans are reused.
+// Keysyms that cannot be typed get keycode 0.
+// On success, return OK
+// On failure (mapping could not be changed), return -1
+int keymapResolve(Keymap *keymap, Display *display, KeySym *symbols, int count, KeyCode *keycodes, unsigned int *states)
+{
+    if(!keymap->initialized)
+        return FAILED;
+
+    int first = keymap->maximumKeycode + 1;
+    int last = keymap->minimumKeycode - 1;
+
+    keymap->resolvedScans++;
+
+    for(int i = 0; i < count; ++i)
+    {
+        states[i] = 0;
+
+        if(symbols[i] < 256 && keymap->latinKeycodes[symbols[i]] != 0)
+        {
+            keycodes[i] = keymap->latinKeycodes[symbols[i]];
+            states[i] = keymap->latinStates[symbols[i]];
+            continue;
+        }
+
+        SpareKeycode *victim = NULL;
+        keycodes[i] = 0;
+
+        for(int j = 0; j < keymap->spareCount && keycodes[i] == 0; ++j)
+        {
+            if(keymap->spares[j].symbol == symbols[i])
+            {
+                keycodes[i] = keymap->spares[j].keycode;
+                keymap->spares[j].lastUsed = keymap->resolvedScans;
+            }
+            else if(keymap->spares[j].lastUsed != keymap->resolvedScans && (victim == NULL || keymap->spares[j].lastUsed < victim->lastUsed))
+                victim = &keymap->spares[j];
+        }
+
+        if(keycodes[i] != 0 || findKeycode(keymap, symbols[i], &keycodes[i], &states[i]))
+            continue;
+
+        // Keycodes already used for this scan cannot be rebound before its characters are typed.
+        if(victim == NULL)
+        {
+            LOG(LOG_WARNING, "  No spare keycode left to type keysym 0x%08lX.", symbols[i]);
+            continue;
+        }
+
+        LOG(LOG_DEBUG, "  Binding keysym 0x%08lX to spare keycode %d.", symbols[i], victim->keycode);
+
+        victim->symbol = symbols[i];
+        victim->lastUsed = keymap->resolvedScans;
+        keycodes[i] = victim->keycode;
+
+        for(int level = 0; level < keymap->keysymsPerKeycode; ++level)
+            keymap->mapping[(victim->keycode - keymap->minimumKeycode) * keymap->keysymsPerKeycode + level] = (level < 2) ? symbols[i] : NoSymbol;
+
+        if(victim->keycode < first)
+            first = victim->keycode;
+
+        if(victim->keycode > last)
+            last = victim->keycode;
+    }
+
+    if(first <= last)
+        return changeMapping(keymap, display, first, last);
+
+    return OK;
+}
+
+// Look for a keysym outside of the Latin-1 range in the first two levels of the mapping.
+int findKeycode(Keymap *keymap, KeySym symbol, KeyCode *keycode, unsigned int *state)
+{
+    for(int code = keymap->minimumKeycode; code <= keymap->maximumKeycode; ++code)
+        for(int level = 0; level < 2 && level < keymap->keysymsPerKeycode; ++level)
+            if(keymap->mapping[(code - keymap->minimumKeycode) * keymap->keysymsPerKeycode + level] == symbol)
+            {
+                *keycode = code;
+                *state = level ? ShiftMask : 0;
+                return TRUE;
+            }
+
+    return FALSE;
+}
+
+// Send our copy of the mapping for a range of keycodes to the server in a single request.
+int changeMapping(Keymap *keymap, Display *display, int first, int last)
+{
+    LOG(LOG_DEBUG, "  Changing keyboard mapping of keycodes %d to %d.", first, last);
+
+    XChangeKeyboardMapping(display, first, keymap->keysymsPerKeycode, &keymap->mapping[(first - keymap->minimumKeycode) * keymap->keysymsPerKeycode], last - first + 1);
+
+    // Applications must see the new mapping before the key events that use it.
+    XSync(display, False);
+
+    return OK;
+}
+
+// Unbind the spare keycodes, restoring the original mapping.
+void keymapTerminate(Keymap *keymap, Display *display)
+{
+    if(!keymap->initialized)
+        return;
+
+    int first = keymap->maximumKeycode + 1;
+    int last = keymap->minimumKeycode - 1;
+
+    for(int i = 0; i < keymap->spareCount; ++i)
+    {
+        if(keymap->spares[i].symbol == NoSymbol)
+            continue;
+
+        for(int level = 0; level < keymap->keysymsPerKeycode; ++level)
+            keymap->mapping[(keymap->spares[i].keycode - keymap->minimumKeycode) * keymap->keysymsPerKeycode + level] = NoSymbol;
+
+        keymap->spares[i].symbol = NoSymbol;
+
+        if(keymap->spares[i].keycode < first)
+            first = keymap->spares[i].keycode;
+
+        if(keymap->spares[i].keycode > last)
+            last = keymap->spares[i].keycode;
+    }
+
+    if(first <= last && display != NULL)
+    {
+        LOG(LOG_DEBUG, "  Restoring original keyboard mapping.");
+        changeMapping(keymap, display, first, last);
+    }
+
+    XFree(keymap->mapping);
+    keymap->mapping = NULL;
+
+    keymap->initialized = FALSE;
+}
+
+// Unicode characters map to the keysym with the same value in the Latin-1 range
+// and to 0x01000000 + codepoint everywhere else.
+KeySym codepointToKeysym(unsigned int codepoint)
+{
+    if((codepoint >= 0x20 && codepoint <= 0x7E) || (codepoint >= 0xA0 && codepoint <= 0xFF))
+        return codepoint;
+
+    return 0x01000000 | codepoint;
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <X11/Xlib.h>
+
+// Number of spare keycodes remembered as bound to a keysym (least recently used ones are rebound first).
+#define KEYMAP_MAX_SPARE 32
+
+typedef struct
+{
+    KeyCode keycode;            // Keycode without any keysym in the original mapping (the spares lie in a single run)
+    KeySym symbol;              // Keysym currently bound to it, NoSymbol if none
+    unsigned long lastUsed;     // Scan counter value of the last use
+} SpareKeycode;
+
+// Keyboard mapping of a display.
+typedef struct
+{
+    int minimumKeycode;
+    int maximumKeycode;
+    int keysymsPerKeycode;
+    KeySym *mapping;                    // Copy of the server mapping, kept up to date with our own changes.
+
+    KeyCode latinKeycodes[256];         // Keycode and modifiers typing each Latin-1 keysym, 0 if none.
+    unsigned int latinStates[256];
+
+    SpareKeycode spares[KEYMAP_MAX_SPARE];
+    int spareCount;
+    unsigned long resolvedScans;
+
+    int initialized;
+} Keymap;
+
+int keymapInitialize(Keymap *keymap, Display *display);
+int keymapRefresh(Keymap *keymap, Display *display);
+int keymapResolve(Keymap *keymap, Display *display, KeySym *symbols, int count, KeyCode *keycodes, unsigned int *states);
+void keymapTerminate(Keymap *keymap, Display *display);
+KeySym codepointToKeysym(unsigned int codepoint);
\ No newline at end of file
@@ -1,30 +1,64 @@
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include "common.h"
+#include "seat.h"
 #include "serial.h"
 #include "xorg.h"
-#include "terminators.h"
-
-void handleSignal(int signal);
+#include "protocol.h"
+#include "pacing.h"
+#include "profile.h"
+#include "routing.h"
+#include "settings.h"
+
+int openEvents();
+int receiveSignal();
+int waitForSeats();
+int loopback();
+void reloadSettings();
 void parseCommandLine(int argc, char **argv);
-int parseTerminator(char * string);
 void help(char *path);
 void quit();
 
 // "Global" variables with relative defaults
 char * deviceFile      = "/dev/ttyS0";    // First serial device on the system. Seems a reasonable default.
 
+char * configFile      = NULL;            // No configuration file by default: everything comes from the command line.
+int    optionCount     = 0;               // Command line, kept to apply it again over the file on reload.
+char **options         = NULL;
+
 int    loopbackMode    = FALSE;           // Don't use stdin by default.
-int    loopbackDelay   = 2;               // Two seconds should be just enough to switch windows with ALT+TAB.
-int    terminatorIndex = 0;               // Don't print any terminator by default (terminator at index 0 is just XK_VoidSymbol)
 
 int    setSerial       = TRUE;            // Set serial parameters by default.
 
+int    profileMode     = FALSE;           // Don't count the cost of the pipeline stages by default.
+
+int    statisticsMode  = TRUE;            // Print the seat statistics on exit, unless --quiet.
+
+const Protocol *protocol = &protocols[0]; // STX <data> ETX, as sent by the scanner in our laboratory.
+
+Seat   seats[SEAT_MAX];                   // Scanners and the displays they type into (--seat, or --device and $DISPLAY).
+int    seatCount       = 0;
+
+X11Context loopbackContext;               // Display typed into in loopback mode.
+Profiler loopbackProfiler;                // Counters of the main thread in loopback mode.
+
+int    shutdownDeadline = 5000;           // Milliseconds the seats have to finish typing after SIGTERM (well within systemd's 90).
+
+int    signals         = FAILED;          // Descriptor delivering SIGTERM, SIGINT, SIGHUP and SIGUSR1...
+int    stopEvent       = FAILED;          // ...readable once the seats have been asked to stop...
+int    stoppedEvent    = FAILED;          // ...written by every seat thread when it stops...
+int    deadlineTimer   = FAILED;          // ...and expiring when the seats ran out of time to do so.
+
 int main(int argc, char **argv)
 {
-    // Register SIGTERM and SIGINT signals to allow the program to cleanup after itself on exit.
-    signal(SIGTERM, handleSignal);
-    signal(SIGINT, handleSignal);
+    // Writing to a dead X server must not kill the program: the connection is reopened instead.
+    signal(SIGPIPE, SIG_IGN);
 
     //TODO: Try to call LOG with invalid strings and observe the results.
     //      Try to call initialization routines twice and see if the second time they skip initialization.
@@ -32,62 +66,244 @@ int main(int argc, char **argv)
 
     LOG(LOG_INFO, "Starting S.E.D.A.N.O...");
 
-    if(X11Initialize() == FAILED)
+    if(openEvents() == FAILED)
     {
-        LOG(LOG_FATAL, "ERROR: Failed to initialize X11.");
+        LOG(LOG_FATAL, "ERROR: Failed to set up signal handling.");
         quit(1);
     }
 
+    // Displays are shared by the seat threads and the main thread.
+    XInitThreads();
+
     if(loopbackMode)
+        quit(loopback());
+
+    for(int i = 0; i < seatCount; ++i)
+        for(int j = 0; j < i; ++j)
+            if(seatSharesDisplay(&seats[i], &seats[j]))
+            {
+                LOG(LOG_FATAL, "ERROR: Seats %s and %s type into the same display %s: only one seat per display is supported.",
+                    seats[j].devicePath, seats[i].devicePath, XDisplayName(seats[i].displayName));
+                quit(1);
+            }
+
+    for(int i = 0; i < seatCount; ++i)
+        if(seatStart(&seats[i], setSerial, protocol, stopEvent, stoppedEvent) == FAILED)
+        {
+            LOG(LOG_FATAL, "ERROR: Failed to start seat %s.", seats[i].devicePath);
+            quit(1);
+        }
+
+    quit(waitForSeats());
+}
+
+/*
+ *  IMPORTANT NOTICE
+ *
+ *  SIGTERM, SIGINT, SIGHUP and SIGUSR1 are blocked and read from a signalfd by the main loop: nothing runs in a signal
+ *  handler, so a signal can never interrupt a scan halfway or deadlock on a lock held by the code it
+ *  interrupted. The mask is set before any thread is started and is inherited by all of them.
+ */
+int openEvents()
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+
+    if(pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0
+        || (signals = signalfd(-1, &mask, SFD_CLOEXEC)) == FAILED
+        || (stopEvent = eventfd(0, EFD_CLOEXEC)) == FAILED
+        || (stoppedEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == FAILED
+        || (deadlineTimer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == FAILED)
+    {
+        LOG(LOG_ERROR, "  Failed to create the event descriptors.");
+        LOG(LOG_ERROR, "      The error was: %s", strerror(errno));
+        return FAILED;
+    }
+
+    return OK;
+}
+
+// Consume a pending signal. Returns its number.
+int receiveSignal()
+{
+    struct signalfd_siginfo info;
+
+    if(read(signals, &info, sizeof info) != sizeof info)
+        return 0;
+
+    return info.ssi_signo;
+}
+
+// Wait for the seats to stop, either by themselves or because a signal asked them to.
+// On the first signal the seats finish typing what they have received; a second signal, or the
+// deadline expiring, exits without waiting for them. Returns the exit status of the program.
+int waitForSeats()
+{
+    struct pollfd events[3] = { { signals, POLLIN, 0 }, { stoppedEvent, POLLIN, 0 }, { deadlineTimer, POLLIN, 0 } };
+    int stopping = FALSE;
+
+    while(TRUE)
     {
-        printf("Insert a series of strings that will be treated as if read from the scanner (max 255 characters).\n");
-        while (TRUE)
+        if(poll(events, 3, -1) == FAILED)
         {
-            char buffer[256];
+            if(errno == EINTR)
+                continue;
+
+            LOG(LOG_FATAL, "ERROR: Failed to wait for events: %s", strerror(errno));
+            return 1;
+        }
 
-            printf(">>> ");
-            fgets(buffer, 256, stdin);
+        if(events[0].revents & POLLIN)
+        {
+            int signal = receiveSignal();
 
-            if(typeString(buffer, loopbackDelay, terminatorIndex) == FAILED)
+            if(signal == SIGHUP)
+                reloadSettings();
+            else if(signal == SIGUSR1)
             {
-                LOG(LOG_FATAL, "ERROR: Failed to print the string.");
-                quit(1);
+                LOG(LOG_INFO, "Received %s: toggling the intake sessions.", strsignal(signal));
+
+                for(int i = 0; i < seatCount && !stopping; ++i)
+                    seatRequestSession(&seats[i]);
+            }
+            else if(stopping)
+            {
+                LOG(LOG_WARNING, "Received %s again: exiting without waiting for the seats.", strsignal(signal));
+                return 1;
+            }
+            else
+            {
+                LOG(LOG_INFO, "Received %s: finishing the scans in progress...", strsignal(signal));
+                stopping = TRUE;
+
+                uint64_t one = 1;
+                struct itimerspec deadline = { { 0, 0 }, { shutdownDeadline / 1000, (shutdownDeadline % 1000) * 1000000 } };
+
+                if(write(stopEvent, &one, sizeof one) != sizeof one || timerfd_settime(deadlineTimer, 0, &deadline, NULL) == FAILED)
+                {
+                    LOG(LOG_ERROR, "Failed to stop the seats: %s", strerror(errno));
+                    return 1;
+                }
             }
         }
+
+        uint64_t count;
+
+        // Only wakes the loop up: seatStopped tells which seats are done.
+        if((events[1].revents & POLLIN) && read(stoppedEvent, &count, sizeof count) != sizeof count)
+            LOG(LOG_DEBUG, "Spurious wake up from the seats.");
+
+        int stopped = 0;
+
+        for(int i = 0; i < seatCount; ++i)
+            stopped += seatStopped(&seats[i]);
+
+        if(stopped == seatCount)
+        {
+            if(stopping)
+                return 0;
+
+            LOG(LOG_FATAL, "ERROR: Every scanner has been lost.");
+            return 1;
+        }
+
+        if(events[2].revents & POLLIN)
+        {
+            LOG(LOG_WARNING, "Shutdown deadline expired: %d seats are still typing.", seatCount - stopped);
+            return 1;
+        }
     }
-    else
+}
+
+// Type the strings read from stdin on the display of the first seat, until end of file or a signal.
+// Returns the exit status of the program.
+int loopback()
+{
+    if(X11Initialize(&loopbackContext, seats[0].displayName) == FAILED)
+    {
+        LOG(LOG_FATAL, "ERROR: Failed to initialize X11.");
+        return 1;
+    }
+
+    struct pollfd events[2] = { { STDIN_FILENO, POLLIN, 0 }, { signals, POLLIN, 0 } };
+
+    profileStart(&loopbackProfiler, "loopback");
+
+    printf("Insert a series of strings that will be treated as if read from the scanner (max 255 characters).\n");
+    while (TRUE)
     {
-        if(serialInitialize(deviceFile, setSerial) != OK)
+        char buffer[256];
+
+        printf(">>> ");
+        fflush(stdout);
+
+        if(poll(events, 2, -1) == FAILED)
         {
-            LOG(LOG_FATAL, "ERROR: Failed to open serial connection to device.");
-            quit(1);
+            LOG(LOG_FATAL, "ERROR: Failed to wait for input: %s", strerror(errno));
+            return 1;
         }
 
-        while(TRUE)
+        if(events[1].revents & POLLIN)
         {
-            char *string = readBarcode();
+            int signal = receiveSignal();
 
-            if(typeString(string, 0, terminatorIndex) == FAILED)
+            if(signal == SIGUSR1)
+                LOG(LOG_WARNING, "Intake sessions are not available in loopback mode.");
+            else if(signal != SIGHUP)
             {
-                LOG(LOG_FATAL, "ERROR: Failed to print the string.");
-                quit(1);
+                LOG(LOG_INFO, "Received %s: exiting...", strsignal(signal));
+                return 0;
             }
+            else
+                reloadSettings();
+
+            continue;
+        }
+
+        if(fgets(buffer, 256, stdin) == NULL)
+            return 0;
+
+        loopbackContext.settings = settingsAcquire(0);
 
-            // This string has been malloc'd
-            free(string);
+        profileEnter(PROFILE_TYPE);
+        int result = typeString(&loopbackContext, buffer, loopbackContext.settings->delay);
+        profileLeave(PROFILE_TYPE);
+
+        settingsRelease(0);
+        profileScan(&loopbackProfiler, buffer);
+
+        if(result == FAILED)
+        {
+            LOG(LOG_FATAL, "ERROR: Failed to print the string.");
+            return 1;
         }
     }
 }
 
-void handleSignal(int signal)
+// Read the configuration file and the command line again. The new settings apply from the next scan on,
+// unless any of them is invalid: a typo must not silently reset a running station to the defaults.
+void reloadSettings()
 {
-    switch(signal)
+    int errors;
+    Settings *settings = settingsLoad(configFile, optionCount, options, &errors);
+
+    if(errors > 0)
     {
-        case SIGTERM:
-        case SIGINT:
-            LOG(LOG_INFO, "Cleaning up before exit...");
-            quit(0);
+        LOG(LOG_ERROR, "Received SIGHUP: %d invalid settings, keeping the current ones.", errors);
+
+        if(settings != NULL)
+            settingsFree(settings);
+
+        return;
     }
+
+    settingsPublish(settings);
+    LOG(LOG_INFO, "Received SIGHUP: settings reloaded%s%s.", configFile ? " from " : "", configFile ? configFile : "");
 }
 
 void parseCommandLine(int argc, char **argv)
@@ -99,8 +315,20 @@ void parseCommandLine(int argc, char **argv)
     if(FINDSWITCH("--quiet"))
         beQuiet();
 
+    if(FINDSWITCH("--benchmark"))
+    {
+        protocolBenchmark();
+        exit(0);
+    }
+
     setSerial = !FINDSWITCH("--nosetserial");
+    statisticsMode = !FINDSWITCH("--quiet");
     loopbackMode = FINDSWITCH("--loopback");
+    // Profiles are only output: --quiet means there is no point in counting.
+    profileMode = FINDSWITCH("--profile") && !FINDSWITCH("--quiet");
+
+    if(profileMode)
+        profileEnable();
 
     // Strings
     char *device = GETVALUE("--device");
@@ -108,38 +336,55 @@ void parseCommandLine(int argc, char **argv)
     if(device != NULL)
         deviceFile = device;
 
-    // Ints
-    char *delay = GETVALUE("--delay");
-    char *loglevel = GETVALUE("--loglevel");
+    for(char *seat; (seat = GETNTHVALUE("--seat", seatCount)) != NULL; )
+    {
+        if(seatCount == SEAT_MAX)
+        {
+            LOG(LOG_ERROR, "Too many seats: ignoring \"%s\" and the following ones.", seat);
+            break;
+        }
 
-    int parsedDelay = (delay) ? isNatural(delay, -1, -1) : -1;
-    int parsedLevel = (loglevel) ? isNatural(loglevel, LOG_DEBUG, LOG_FATAL) : -1;
+        if(seatParse(&seats[seatCount], seat) == FAILED)
+        {
+            LOG(LOG_ERROR, "\"%s\" is not a valid seat: ignoring it and the following ones.", seat);
+            break;
+        }
 
-    if(parsedDelay != -1)
-        loopbackDelay = parsedDelay;
-    
-    if(parsedLevel != -1)
-        setLogLevel(parsedLevel);
+        seatCount++;
+    }
 
-    char *terminator = GETVALUE("--terminator");
+    // Without seats, type the scans of --device on $DISPLAY.
+    if(seatCount == 0)
+        seatParse(&seats[seatCount++], deviceFile);
 
-    if(parseTerminator(terminator) == FAILED)
-        LOG(LOG_ERROR, "\"%s\" is not a valid terminator: disabling terminator.", terminator);
-}
+    for(int i = 0; i < seatCount; ++i)
+        seats[i].reader = i;
 
-int parseTerminator(char * string)
-{
-    if(string == NULL)
-        return OK;
+    // Everything that can be reloaded. Invalid settings fall back to their defaults at startup.
+    configFile = GETVALUE("--config");
+    optionCount = argc;
+    options = argv;
 
-    for(int i = 0; i < terminatorCount; ++i)
-        if(SAMESTR(string, terminatorNames[i]))
-        {
-            terminatorIndex = i;
-            return OK;
-        }
+    int errors;
+    Settings *settings = settingsLoad(configFile, argc, argv, &errors);
 
-    return FAILED;
+    if(settings == NULL)
+    {
+        LOG(LOG_FATAL, "ERROR: Failed to load the settings.");
+        exit(1);
+    }
+
+    settingsPublish(settings);
+
+    char *protocolName = GETVALUE("--protocol");
+
+    if(protocolName != NULL)
+    {
+        if(protocolFind(protocolName) != NULL)
+            protocol = protocolFind(protocolName);
+        else
+            LOG(LOG_ERROR, "\"%s\" is not a valid protocol: using %s.", protocolName, protocol->name);
+    }
 }
 
 void help(char *path)
@@ -147,26 +392,72 @@ void help(char *path)
     //TODO: Actual documentation
     printf("Usage: %s [options]\n", path);
     printf("\nCommand line options:\n");
-    printf("    --device <path>    : Specifies device file to use.\n\n");
-    printf("    --terminator <key> : Terminates all inputs with a given keypress. See the following section for valid terminators.\n");
+    printf("    --device <path>    : Specifies device file to use.\n");
+    printf("    --seat <dev>=<disp>: Types the scans of a device on a display. Can be repeated, replaces --device.\n");
+    printf("    --protocol <name>  : Specifies how the scanner frames barcodes. See the following section for valid protocols.\n");
+    printf("    --config <path>    : Reads the following settings from a file, reloaded on SIGHUP.\n\n");
+    printf("    --terminator <keys>: Terminates all inputs with a sequence of keypresses. See the following section for valid terminators.\n");
     printf("    --loglevel <level> : Specifies output loglevel (%d = Debug, %d = Fatal).\n", LOG_DEBUG, LOG_FATAL);
-    printf("    --delay <seconds>  : Specifies seconds of delay between scanner read and X11 write.\n\n");
+    printf("    --delay <seconds>  : Specifies seconds of delay between scanner read and X11 write.\n");
+    printf("    --keydelay <us>    : Specifies microseconds of delay between keystrokes.\n");
+    printf("    --pacing           : Adapts the delay between keystrokes to the focused application (never below --keydelay without _NET_WM_PING).\n");
+    printf("    --route <rules>    : Types scans into the windows selected by the rules instead of the focused one.\n");
+    printf("    --ack <hex>        : Sends these bytes to the scanner once a scan has been typed (beep, LED...).\n");
+    printf("    --nack <hex>       : Sends these bytes to the scanner when a scan could not be typed.\n");
+    printf("    --sessionstart <id>: Control barcode starting an intake session (also SIGUSR1).\n");
+    printf("    --sessionend <id>  : Control barcode submitting the scans of the session.\n");
+    printf("    --sessionoutput <o>: Where sessions go: type, file:<path> or socket:<path>.\n");
+    printf("    --sessionformat <f>: How sessions are written: tsv, csv or ndjson.\n\n");
     printf("    --loopback         : Enables loopback mode (read from stdin instead of scanner).\n");
     printf("    --nosetserial      : Skips serial parameter initialization.\n\n");
+    printf("    --profile          : Counts the cycles, instructions, cache misses and context switches of every scan.\n");
+    printf("    --benchmark        : Measures the decoding throughput of every protocol and exits.\n");
     printf("    --quiet            : Suppresses ALL output (including fatal errors).\n");
     printf("    --help             : Shows this screen.\n");
-    printf("\nValid terminator IDs:\n");
-    printf("    ENTER\n");
-    printf("    TABULATION\n");
-    printf("    SPACE\n");
+    settingsHelp();
+    printf("\nValid protocols:\n");
+    for(int i = 0; i < protocolCount; ++i)
+        printf("    %-8s: %s%s\n", protocols[i].name, protocols[i].description, (i == 0) ? " (default)" : "");
     exit(0);
 }
 
 void quit(int level)
 {
+    LOG(LOG_INFO, "Cleaning up before exit...");
+
     // Call cleanup functions
-    serialTerminate();
-    X11Terminate();
+    if(loopbackMode)
+    {
+        X11Terminate(&loopbackContext);
+        profileStop(&loopbackProfiler);
+    }
+    else
+    {
+        for(int i = 0; i < seatCount; ++i)
+            seatTerminate(&seats[i]);
+
+        if(statisticsMode)
+        {
+            printf("\nSeat statistics:\n");
+            for(int i = 0; i < seatCount; ++i)
+                seatReport(&seats[i]);
+        }
+    }
+
+    if(profileMode)
+    {
+        printf("\nProfile statistics:\n");
+
+        if(loopbackMode)
+            profileReport(&loopbackProfiler);
+
+        for(int i = 0; i < seatCount && !loopbackMode; ++i)
+            profileReport(&seats[i].profiler);
+    }
+
+    settingsTerminate();
 
+    // Logs and statistics must reach the journal even if stdout is not a terminal.
+    fflush(stdout);
     exit(level);
 }
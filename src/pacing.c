@@ -0,0 +1,130 @@
+#include <time.h>
+
+#include "common.h"
+#include "pacing.h"
+
+// Upper bound of the adaptive gap: 20ms is slower than any human typist.
+#define PACING_MAXIMUM_GAP 20000
+
+// Set the gap between keystrokes. In adaptive mode it is the starting point for unknown applications, and the
+// controller never goes slower than the largest of it and the default maximum.
+// Called before every scan, so that reloaded settings apply at once; learned gaps are kept.
+void pacingConfigure(Pacing *pacing, int adaptive, long initialGap)
+{
+    pacing->adaptive = adaptive;
+    pacing->initialGap = initialGap;
+    pacing->maximumGap = (initialGap > PACING_MAXIMUM_GAP) ? initialGap : PACING_MAXIMUM_GAP;
+}
+
+int pacingIsAdaptive(Pacing *pacing)
+{
+    return pacing->adaptive;
+}
+
+// Pick the gap to use while typing a scan into a window of the given class.
+// Returns the gap in microseconds.
+long pacingBegin(Pacing *pacing, const char *windowClass)
+{
+    pacing->current = NULL;
+
+    if(!pacing->adaptive)
+        return pacing->initialGap;
+
+    pacing->scans++;
+
+    if(windowClass == NULL)
+        windowClass = "";
+
+    PacingEntry *oldest = &pacing->cache[0];
+
+    for(int i = 0; i < PACING_CACHE_SIZE; ++i)
+    {
+        if(pacing->cache[i].lastUsed != 0 && strcmp(pacing->cache[i].windowClass, windowClass) == 0)
+        {
+            pacing->current = &pacing->cache[i];
+            break;
+        }
+
+        if(pacing->cache[i].lastUsed < oldest->lastUsed)
+            oldest = &pacing->cache[i];
+    }
+
+    // First scan for this window class: replace the least recently used entry.
+    if(pacing->current == NULL)
+    {
+        pacing->current = oldest;
+
+        snprintf(pacing->current->windowClass, sizeof pacing->current->windowClass, "%s", windowClass);
+        pacing->current->gap = pacing->initialGap;
+        pacing->current->baseline = 0;
+
+        LOG(LOG_DEBUG, "  Learning the pace of windows of class \"%s\".", pacing->current->windowClass);
+    }
+
+    pacing->current->lastUsed = pacing->scans;
+
+    LOG(LOG_DEBUG, "  Typing into \"%s\" with a gap of %ldus.", pacing->current->windowClass, pacing->current->gap);
+    return pacing->current->gap;
+}
+
+// Update the gap given the round-trip time of the last delivery probe.
+// A round-trip well above the usual one means events are piling up: back off quickly.
+// Otherwise speed up a little at a time, converging on the fastest pace that keeps the round-trip low.
+// Only a probe answered by the application itself tells whether it keeps up: an XSync round-trip does not
+// depend on the gap, so when that is all there is the gap never goes below the configured one.
+// Returns the gap to use from now on.
+long pacingFeedback(Pacing *pacing, long roundTrip, int fromApplication)
+{
+    if(pacing->current == NULL)
+        return pacing->initialGap;
+
+    long baseline = pacing->current->baseline;
+    long minimumGap = fromApplication ? 0 : pacing->initialGap;
+
+    if(baseline == 0 || roundTrip <= 2 * baseline + 100)
+    {
+        pacing->current->baseline = (baseline == 0) ? roundTrip : (7 * baseline + roundTrip) / 8;
+        pacing->current->gap -= pacing->current->gap / 8 + 1;
+
+        if(pacing->current->gap < minimumGap)
+            pacing->current->gap = minimumGap;
+    }
+    else
+    {
+        pacing->current->gap = 2 * pacing->current->gap + 100;
+
+        if(pacing->current->gap > pacing->maximumGap)
+            pacing->current->gap = pacing->maximumGap;
+
+        LOG(LOG_DEBUG, "    Round-trip of %ldus (usually %ldus): slowing down to %ldus.", roundTrip, baseline, pacing->current->gap);
+    }
+
+    return pacing->current->gap;
+}
+
+// Sleep for the given number of microseconds.
+void pacingWait(long gap)
+{
+    if(gap <= 0)
+        return;
+
+    struct timespec duration = { gap / 1000000, (gap % 1000000) * 1000 };
+
+    while(nanosleep(&duration, &duration) == FAILED && errno == EINTR);
+}
+
+void pacingEnd(Pacing *pacing)
+{
+    if(pacing->current != NULL)
+        LOG(LOG_DEBUG, "  Learned a gap of %ldus for \"%s\".", pacing->current->gap, pacing->current->windowClass);
+
+    pacing->current = NULL;
+}
+
+long microsecondsSince(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <time.h>
+
+// Keystrokes sent between two delivery probes (_NET_WM_PING or XSync round-trips) in adaptive mode.
+#define PACING_PROBE_INTERVAL 8
+
+// Milliseconds an application has to answer a _NET_WM_PING probe.
+#define PACING_PING_TIMEOUT 250
+
+// Number of window classes whose learned pace is remembered.
+#define PACING_CACHE_SIZE 32
+
+typedef struct
+{
+    char windowClass[64];       // WM_CLASS of the windows this entry applies to
+    long gap;                   // Learned gap between keystrokes, in microseconds
+    long baseline;              // Typical round-trip time when the application keeps up, in microseconds
+    unsigned long lastUsed;     // Scan counter value of the last use (for replacement)
+} PacingEntry;
+
+// Pace learned for the applications of a display.
+typedef struct
+{
+    PacingEntry cache[PACING_CACHE_SIZE];
+    PacingEntry *current;
+    unsigned long scans;
+
+    int adaptive;               // Adapt the gap to the probes instead of using a fixed one.
+    long initialGap;            // Gap for applications never seen before, floor of XSync probes (the fixed gap if not adaptive).
+    long maximumGap;            // Upper bound of the adaptive gap.
+} Pacing;
+
+void pacingConfigure(Pacing *pacing, int adaptive, long initialGap);
+int pacingIsAdaptive(Pacing *pacing);
+long pacingBegin(Pacing *pacing, const char *windowClass);
+long pacingFeedback(Pacing *pacing, long roundTrip, int fromApplication);
+void pacingWait(long gap);
+void pacingEnd(Pacing *pacing);
+long microsecondsSince(struct timespec *start);
\ No newline at end of file
@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "profile.h"
+
+// Sources of a counter tried in order, the first one that can be opened wins.
+#define PROFILE_SOURCES 2
+
+// Counter read from getrusage() instead of perf_event.
+#define PROFILE_RUSAGE PERF_TYPE_MAX
+
+typedef struct
+{
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+    int kernelOnly;             // The events happen in the kernel: there is nothing to count in user space
+} CounterSource;
+
+CounterSource counterSources[PROFILE_COUNTERS][PROFILE_SOURCES] =
+{
+    { { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, FALSE },            { "task-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, FALSE } },
+    { { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, FALSE },    { NULL, 0, 0, FALSE } },
+    { { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, FALSE },   { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, FALSE } },
+    { { "ctx-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, TRUE }, { "ctx-switches", PROFILE_RUSAGE, 0, FALSE } }
+};
+
+char *stageNames[PROFILE_STAGES] = { "read", "type", "log" };
+
+int profiling = FALSE;                      // Set by --profile.
+__thread Profiler *threadProfiler = NULL;   // Profiler of the calling thread (NULL if it is not profiled).
+
+int openCounter(Profiler *profiler, const CounterSource *source);
+void readCounters(Profiler *profiler, unsigned long long *values);
+void printSample(Profiler *profiler, int stage, ProfileSample *sample, unsigned long divisor);
+
+/*
+ *  IMPORTANT NOTICE
+ *
+ *  Counters only count the thread that opened them (pid 0, any CPU), so every seat thread opens its own in
+ *  profileStart and nothing is shared between threads: profileEnter and profileLeave find the counters of
+ *  the caller through a thread-local pointer, which is NULL (and the calls nearly free) without --profile.
+ *
+ *  All the counters of a thread are opened as a single perf_event group, so that a stage boundary costs one
+ *  read() whatever the number of counters. Unprivileged users can only count user space when
+ *  /proc/sys/kernel/perf_event_paranoid is 2 or more: the kernel part is then excluded, and context switches,
+ *  which only happen in the kernel, are taken from getrusage() instead.
+ */
+
+void profileEnable()
+{
+    profiling = TRUE;
+}
+
+// Open the counters of the calling thread and start measuring its stages.
+void profileStart(Profiler *profiler, const char *name)
+{
+    if(!profiling)
+        return;
+
+    memset(profiler, 0, sizeof *profiler);
+    profiler->name = name;
+    profiler->rusage = FAILED;
+
+    for(int i = 0; i < PROFILE_COUNTERS; ++i)
+    {
+        profiler->slots[i] = FAILED;
+
+        for(int j = 0; j < PROFILE_SOURCES && profiler->counterNames[i] == NULL; ++j)
+        {
+            const CounterSource *source = &counterSources[i][j];
+
+            if(source->name == NULL)
+                continue;
+
+            if(source->type == PROFILE_RUSAGE)
+            {
+                profiler->rusage = i;
+                profiler->counterNames[i] = source->name;
+                continue;
+            }
+
+            int descriptor = openCounter(profiler, source);
+
+            if(descriptor == FAILED)
+            {
+                LOG(LOG_DEBUG, "  Counter %s not available: %s", source->name, strerror(errno));
+                continue;
+            }
+
+            profiler->slots[i] = profiler->members;
+            profiler->descriptors[profiler->members++] = descriptor;
+            profiler->counterNames[i] = source->name;
+            profiler->hardware |= (source->type == PERF_TYPE_HARDWARE);
+        }
+    }
+
+    if(profiler->members == 0)
+        LOG(LOG_WARNING, "perf_event counters not available for %s (see /proc/sys/kernel/perf_event_paranoid): only counting context switches.", name);
+    else if(!profiler->hardware)
+        LOG(LOG_WARNING, "Hardware counters not available for %s: counting software events instead.", name);
+
+    LOG(LOG_INFO, "Profiling %s%s.", name, profiler->userOnly ? " (user space only)" : "");
+
+    threadProfiler = profiler;
+}
+
+int openCounter(Profiler *profiler, const CounterSource *source)
+{
+    struct perf_event_attr attributes;
+
+    if(profiler->userOnly && source->kernelOnly)
+    {
+        errno = EACCES;
+        return FAILED;
+    }
+
+    memset(&attributes, 0, sizeof attributes);
+    attributes.size = sizeof attributes;
+    attributes.type = source->type;
+    attributes.config = source->config;
+    attributes.read_format = PERF_FORMAT_GROUP;
+    attributes.exclude_kernel = profiler->userOnly;
+    attributes.exclude_hv = 1;
+
+    int group = (profiler->members > 0) ? profiler->descriptors[0] : -1;
+    int descriptor = syscall(SYS_perf_event_open, &attributes, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+
+    // Not allowed to count the kernel: the first counter decides for all of them, so that they stay comparable.
+    // Later ones that cannot count what the group already counts are left out.
+    if(descriptor == FAILED && (errno == EACCES || errno == EPERM) && profiler->members == 0 && !source->kernelOnly)
+    {
+        profiler->userOnly = TRUE;
+        attributes.exclude_kernel = 1;
+        descriptor = syscall(SYS_perf_event_open, &attributes, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+    }
+
+    return descriptor;
+}
+
+void readCounters(Profiler *profiler, unsigned long long *values)
+{
+    memset(values, 0, PROFILE_COUNTERS * sizeof *values);
+
+    if(profiler->members > 0)
+    {
+        // Number of counters, then their values in the order they were opened.
+        unsigned long long group[1 + PROFILE_COUNTERS];
+
+        if(read(profiler->descriptors[0], group, sizeof group) > 0)
+            for(int i = 0; i < PROFILE_COUNTERS; ++i)
+                if(profiler->slots[i] != FAILED)
+                    values[i] = group[1 + profiler->slots[i]];
+    }
+
+    if(profiler->rusage != FAILED)
+    {
+        struct rusage usage;
+
+        if(getrusage(RUSAGE_THREAD, &usage) == OK)
+            values[profiler->rusage] = usage.ru_nvcsw + usage.ru_nivcsw;
+    }
+}
+
+// Start measuring a stage of the calling thread. Nested calls of the same stage are part of the outermost one.
+void profileEnter(int stage)
+{
+    Profiler *profiler = threadProfiler;
+
+    if(profiler == NULL || profiler->depth[stage]++ > 0)
+        return;
+
+    readCounters(profiler, profiler->started[stage]);
+}
+
+void profileLeave(int stage)
+{
+    Profiler *profiler = threadProfiler;
+
+    if(profiler == NULL || --profiler->depth[stage] > 0)
+        return;
+
+    unsigned long long now[PROFILE_COUNTERS];
+
+    readCounters(profiler, now);
+
+    for(int i = 0; i < PROFILE_COUNTERS; ++i)
+    {
+        profiler->scan[stage].values[i] += now[i] - profiler->started[stage][i];
+        profiler->total[stage].values[i] += now[i] - profiler->started[stage][i];
+    }
+
+    profiler->scan[stage].calls++;
+    profiler->total[stage].calls++;
+}
+
+// Print what the stages cost since the previous scan.
+void profileScan(Profiler *profiler, const char *barcode)
+{
+    if(!profiling)
+        return;
+
+    profiler->scans++;
+
+    // Every seat prints from its own thread: keep the lines of a scan together.
+    flockfile(stdout);
+    printf("Profile of scan %lu on %s (\"%.*s\"):\n", profiler->scans, profiler->name, (int) strcspn(barcode, "\r\n"), barcode);
+
+    for(int i = 0; i < PROFILE_STAGES; ++i)
+        if(profiler->scan[i].calls > 0)
+            printSample(profiler, i, &profiler->scan[i], 1);
+
+    funlockfile(stdout);
+
+    memset(profiler->scan, 0, sizeof profiler->scan);
+}
+
+// Print the average cost of every stage. Only meaningful once the profiled thread has stopped.
+void profileReport(Profiler *profiler)
+{
+    if(!profiling || profiler->name == NULL)
+        return;
+
+    printf("%-16s: %lu scans, averages per call%s%s:\n", profiler->name, profiler->scans,
+        profiler->userOnly ? ", user space only" : "", profiler->hardware ? "" : ", no hardware counters");
+
+    for(int i = 0; i < PROFILE_STAGES; ++i)
+        if(profiler->total[i].calls > 0)
+            printSample(profiler, i, &profiler->total[i], profiler->total[i].calls);
+}
+
+void printSample(Profiler *profiler, int stage, ProfileSample *sample, unsigned long divisor)
+{
+    printf("    %-4s: %6lu calls", stageNames[stage], sample->calls);
+
+    for(int i = 0; i < PROFILE_COUNTERS; ++i)
+        if(profiler->counterNames[i] != NULL)
+            printf(", %llu %s", sample->values[i] / divisor, profiler->counterNames[i]);
+
+    // Instructions per cycle need both hardware counters.
+    if(profiler->counterNames[0] == counterSources[0][0].name && profiler->counterNames[1] != NULL && sample->values[0] > 0)
+        printf(", %.2f IPC", (double) sample->values[1] / sample->values[0]);
+
+    printf("\n");
+}
+
+// Close the counters of the calling thread. What they measured is kept for profileReport.
+void profileStop(Profiler *profiler)
+{
+    if(threadProfiler == profiler)
+        threadProfiler = NULL;
+
+    for(int i = 0; i < profiler->members; ++i)
+        close(profiler->descriptors[i]);
+
+    profiler->members = 0;
+}
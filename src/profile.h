@@ -0,0 +1,45 @@
+#pragma once
+
+// Pipeline stages measured by --profile. Stages can nest: the logs written while reading or typing
+// a scan are counted both in their stage and in PROFILE_LOG.
+#define PROFILE_READ    0
+#define PROFILE_TYPE    1
+#define PROFILE_LOG     2
+#define PROFILE_STAGES  3
+
+// Cycles, instructions, cache misses and context switches (or their software replacements).
+#define PROFILE_COUNTERS 4
+
+typedef struct
+{
+    unsigned long calls;
+    unsigned long long values[PROFILE_COUNTERS];
+} ProfileSample;
+
+// Counters of the thread that typed the scans of a seat (or of loopback mode).
+typedef struct
+{
+    const char *name;                                       // Seat the counters belong to
+
+    int descriptors[PROFILE_COUNTERS];                      // perf_event group, read in a single call through the first one
+    int members;
+    int slots[PROFILE_COUNTERS];                            // Position of every counter in the group (FAILED if not in it)
+    const char *counterNames[PROFILE_COUNTERS];             // Event actually counted (NULL if unavailable)
+    int hardware;                                           // Whether any hardware counter could be opened
+    int userOnly;                                           // Whether the kernel part of the events is excluded
+    int rusage;                                             // Counter read from getrusage() instead (FAILED if none)
+
+    int depth[PROFILE_STAGES];                              // Nesting of every stage: only the outermost is measured
+    unsigned long long started[PROFILE_STAGES][PROFILE_COUNTERS];
+    ProfileSample scan[PROFILE_STAGES];                     // Since the last scan...
+    ProfileSample total[PROFILE_STAGES];                    // ...and since the start.
+    unsigned long scans;
+} Profiler;
+
+void profileEnable();
+void profileStart(Profiler *profiler, const char *name);
+void profileEnter(int stage);
+void profileLeave(int stage);
+void profileScan(Profiler *profiler, const char *barcode);
+void profileReport(Profiler *profiler);
+void profileStop(Profiler *profiler);
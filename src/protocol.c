@@ -0,0 +1,374 @@
+#include <time.h>
+
+#include "common.h"
+#include "protocol.h"
+
+// Actions performed by the decoder on a byte
+#define ACTION_SKIP     0   // Ignore the byte
+#define ACTION_BEGIN    1   // Start a new frame (the byte is a marker and is not stored)
+#define ACTION_FIRST    2   // Start a new frame with the byte as its first character
+#define ACTION_APPEND   3   // Store the byte in the current frame
+#define ACTION_RESYNC   4   // Unexpected start marker: drop the current frame and start a new one
+#define ACTION_EMIT     5   // End marker: deliver the current frame
+#define ACTION_CLOSE    6   // End marker followed by a checksum: add it to the checksum
+#define ACTION_LENGTH   7   // Store the declared length of a packet
+#define ACTION_PAYLOAD  8   // Store a byte of a length-prefixed payload
+#define ACTION_VERIFY   9   // Compare the checksum and deliver or drop the frame
+
+#define T(state, action) { STATE_##state, ACTION_##action }
+
+/*
+ *      Transition tables
+ *      =================
+ *
+ *      Every protocol is a table indexed by [current state][class of the received byte].
+ *      Columns are CLASS_OTHER, CLASS_START and CLASS_END. States a protocol never enters
+ *      fall back to hunting, so a table only needs to describe the states it uses.
+ */
+
+// STX <data> ETX
+const Transition stxTable[STATE_COUNT][CLASS_COUNT] =
+{
+    [STATE_HUNT]     = { T(HUNT, SKIP),     T(DATA, BEGIN),  T(HUNT, SKIP) },
+    [STATE_DATA]     = { T(DATA, APPEND),   T(DATA, RESYNC), T(HUNT, EMIT) },
+    [STATE_DISCARD]  = { T(DISCARD, SKIP),  T(DATA, BEGIN),  T(HUNT, SKIP) },
+    [STATE_LENGTH]   = { T(HUNT, SKIP),     T(HUNT, SKIP),   T(HUNT, SKIP) },
+    [STATE_PAYLOAD]  = { T(HUNT, SKIP),     T(HUNT, SKIP),   T(HUNT, SKIP) },
+    [STATE_CHECKSUM] = { T(HUNT, SKIP),     T(HUNT, SKIP),   T(HUNT, SKIP) }
+};
+
+// STX <data> ETX <BCC>
+const Transition bccTable[STATE_COUNT][CLASS_COUNT] =
+{
+    [STATE_HUNT]     = { T(HUNT, SKIP),     T(DATA, BEGIN),     T(HUNT, SKIP) },
+    [STATE_DATA]     = { T(DATA, APPEND),   T(DATA, RESYNC),    T(CHECKSUM, CLOSE) },
+    [STATE_DISCARD]  = { T(DISCARD, SKIP),  T(DATA, BEGIN),     T(HUNT, SKIP) },
+    [STATE_LENGTH]   = { T(HUNT, SKIP),     T(HUNT, SKIP),      T(HUNT, SKIP) },
+    [STATE_PAYLOAD]  = { T(HUNT, SKIP),     T(HUNT, SKIP),      T(HUNT, SKIP) },
+    [STATE_CHECKSUM] = { T(HUNT, VERIFY),   T(HUNT, VERIFY),    T(HUNT, VERIFY) }
+};
+
+// <data> CR and/or LF (empty lines are skipped)
+const Transition lineTable[STATE_COUNT][CLASS_COUNT] =
+{
+    [STATE_HUNT]     = { T(DATA, FIRST),    T(DATA, FIRST),  T(HUNT, SKIP) },
+    [STATE_DATA]     = { T(DATA, APPEND),   T(DATA, APPEND), T(HUNT, EMIT) },
+    [STATE_DISCARD]  = { T(DISCARD, SKIP),  T(DISCARD, SKIP), T(HUNT, SKIP) },
+    [STATE_LENGTH]   = { T(HUNT, SKIP),     T(HUNT, SKIP),   T(HUNT, SKIP) },
+    [STATE_PAYLOAD]  = { T(HUNT, SKIP),     T(HUNT, SKIP),   T(HUNT, SKIP) },
+    [STATE_CHECKSUM] = { T(HUNT, SKIP),     T(HUNT, SKIP),   T(HUNT, SKIP) }
+};
+
+// STX <length> <data> <BCC>: the payload is binary, so the class of its bytes is irrelevant
+const Transition packetTable[STATE_COUNT][CLASS_COUNT] =
+{
+    [STATE_HUNT]     = { T(HUNT, SKIP),         T(LENGTH, BEGIN),       T(HUNT, SKIP) },
+    [STATE_DATA]     = { T(HUNT, SKIP),         T(HUNT, SKIP),          T(HUNT, SKIP) },
+    [STATE_DISCARD]  = { T(HUNT, SKIP),         T(HUNT, SKIP),          T(HUNT, SKIP) },
+    [STATE_LENGTH]   = { T(PAYLOAD, LENGTH),    T(PAYLOAD, LENGTH),     T(PAYLOAD, LENGTH) },
+    [STATE_PAYLOAD]  = { T(PAYLOAD, PAYLOAD),   T(PAYLOAD, PAYLOAD),    T(PAYLOAD, PAYLOAD) },
+    [STATE_CHECKSUM] = { T(HUNT, VERIFY),       T(HUNT, VERIFY),        T(HUNT, VERIFY) }
+};
+
+/*
+ *      IMPORTANT NOTICE:
+ *      =================
+ *
+ *      In order to add a protocol, describe its markers and point it to the transition table
+ *      that recognizes its framing (adding a new table if none of the existing ones fits).
+ *
+ *      Protocol 0 is the default one.
+ */
+
+const Protocol protocols[] =
+{
+    { "STX",    "STX <data> ETX",                               0x02,   "\x03",   FALSE,  FALSE,  stxTable    },
+    { "STXBCC", "STX <data> ETX <XOR of data and ETX>",         0x02,   "\x03",   TRUE,   FALSE,  bccTable    },
+    { "LINE",   "<data> CR/LF",                                 -1,     "\r\n",   FALSE,  FALSE,  lineTable   },
+    { "AIM",    "]<symbology><modifier> <data> CR/LF",          -1,     "\r\n",   FALSE,  TRUE,   lineTable   },
+    { "PACKET", "STX <length> <data> <XOR of length and data>", 0x02,   NULL,     TRUE,   FALSE,  packetTable }
+};
+
+const int protocolCount = sizeof(protocols) / sizeof(protocols[0]);
+
+void deliverFrame(Decoder *decoder, FrameHandler handler, void *context);
+void dropFrame(Decoder *decoder, const char *reason);
+
+// Find a protocol by name. Returns NULL if there is none.
+const Protocol *protocolFind(const char *name)
+{
+    if(name == NULL)
+        return NULL;
+
+    for(int i = 0; i < protocolCount; ++i)
+        if(SAMESTR(name, protocols[i].name))
+            return &protocols[i];
+
+    return NULL;
+}
+
+// Prepare a decoder for the given protocol by classifying every possible byte beforehand.
+void decoderInitialize(Decoder *decoder, const Protocol *protocol)
+{
+    memset(decoder, 0, sizeof *decoder);
+
+    decoder->protocol = protocol;
+    decoder->state = STATE_HUNT;
+
+    if(protocol->start >= 0)
+        decoder->classes[(unsigned char) protocol->start] = CLASS_START;
+
+    if(protocol->ends != NULL)
+        for(const char *end = protocol->ends; *end; ++end)
+            decoder->classes[(unsigned char) *end] = CLASS_END;
+}
+
+// Run a whole block of received bytes through the state machine, calling the handler for every
+// complete frame. Partial frames are kept in the decoder and completed by the following blocks.
+void decoderFeed(Decoder *decoder, const unsigned char *bytes, size_t count, FrameHandler handler, void *context)
+{
+    const Transition (*table)[CLASS_COUNT] = decoder->protocol->table;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        unsigned char byte = bytes[i];
+        Transition transition = table[decoder->state][decoder->classes[byte]];
+
+        decoder->state = transition.next;
+
+        switch(transition.action)
+        {
+            case ACTION_SKIP:
+                break;
+
+            case ACTION_RESYNC:
+                dropFrame(decoder, "unexpected start of frame");
+                // Fall through: the marker opens the next frame.
+            case ACTION_BEGIN:
+                decoder->length = 0;
+                decoder->checksum = 0;
+                break;
+
+            case ACTION_FIRST:
+                decoder->length = 0;
+                decoder->checksum = 0;
+                // Fall through: the byte is part of the payload.
+            case ACTION_APPEND:
+                if(decoder->length == PROTOCOL_MAX_FRAME)
+                {
+                    dropFrame(decoder, "frame too long");
+                    decoder->state = STATE_DISCARD;
+                    break;
+                }
+
+                decoder->frame[decoder->length++] = byte;
+                decoder->checksum ^= byte;
+                break;
+
+            case ACTION_EMIT:
+                deliverFrame(decoder, handler, context);
+                break;
+
+            case ACTION_CLOSE:
+                decoder->checksum ^= byte;
+                break;
+
+            case ACTION_LENGTH:
+                decoder->expected = byte;
+                decoder->checksum ^= byte;
+
+                if(decoder->expected == 0)
+                    decoder->state = STATE_CHECKSUM;
+                break;
+
+            case ACTION_PAYLOAD:
+                decoder->frame[decoder->length++] = byte;
+                decoder->checksum ^= byte;
+
+                if(decoder->length == decoder->expected)
+                    decoder->state = STATE_CHECKSUM;
+                break;
+
+            case ACTION_VERIFY:
+                if(decoder->checksum == byte)
+                {
+                    deliverFrame(decoder, handler, context);
+                    break;
+                }
+
+                // A corrupt length byte can make a packet swallow the start of the following ones:
+                // search them again in the bytes that followed the false start.
+                if(decoder->protocol->ends == NULL)
+                {
+                    unsigned char replay[0xFF + 2];
+                    int replayLength = 0;
+
+                    replay[replayLength++] = decoder->expected;
+                    memcpy(replay + replayLength, decoder->frame, decoder->length);
+                    replayLength += decoder->length;
+                    replay[replayLength++] = byte;
+
+                    dropFrame(decoder, "checksum mismatch");
+                    decoderFeed(decoder, replay, replayLength, handler, context);
+                }
+                else
+                    dropFrame(decoder, "checksum mismatch");
+                break;
+        }
+    }
+}
+
+// Hand a complete frame to the handler, stripping the symbology identifier where needed.
+void deliverFrame(Decoder *decoder, FrameHandler handler, void *context)
+{
+    char *frame = decoder->frame;
+    int length = decoder->length;
+
+    frame[length] = 0;
+
+    if(decoder->protocol->aimPrefix)
+    {
+        if(length < 3 || frame[0] != ']')
+        {
+            dropFrame(decoder, "missing AIM symbology identifier");
+            return;
+        }
+
+        LOG(LOG_DEBUG, "  Frame has AIM symbology identifier ]%c%c.", frame[1], frame[2]);
+
+        frame += 3;
+        length -= 3;
+    }
+
+    decoder->frames++;
+    handler(frame, length, context);
+}
+
+void dropFrame(Decoder *decoder, const char *reason)
+{
+    decoder->corrupt++;
+    decoder->length = 0;
+
+    LOG(LOG_WARNING, "  Discarding corrupt %s frame: %s.", decoder->protocol->name, reason);
+}
+
+// Encode a payload as the scanner would send it. The buffer must hold at least PROTOCOL_MAX_FRAME + 6 bytes.
+// On success, return the number of encoded bytes
+// On failure, return -1
+int protocolEncode(const Protocol *protocol, const char *payload, unsigned char *buffer)
+{
+    int length = strlen(payload);
+    int encoded = 0;
+    unsigned char checksum = 0;
+
+    if(length + 3 > PROTOCOL_MAX_FRAME || (protocol->ends == NULL && length > 0xFF))
+        return FAILED;
+
+    if(protocol->start >= 0)
+        buffer[encoded++] = protocol->start;
+
+    if(protocol->ends == NULL)
+    {
+        buffer[encoded++] = length;
+        checksum ^= length;
+    }
+
+    if(protocol->aimPrefix)
+    {
+        memcpy(buffer + encoded, "]C0", 3);
+        encoded += 3;
+        checksum ^= ']' ^ 'C' ^ '0';
+    }
+
+    for(int i = 0; i < length; ++i)
+    {
+        buffer[encoded++] = payload[i];
+        checksum ^= payload[i];
+    }
+
+    if(protocol->ends != NULL)
+    {
+        buffer[encoded++] = protocol->ends[0];
+        checksum ^= protocol->ends[0];
+    }
+
+    if(protocol->checksum)
+        buffer[encoded++] = checksum;
+
+    return encoded;
+}
+
+void countFrame(char *frame, int length, void *context)
+{
+    (*(unsigned long *) context)++;
+}
+
+// Measure the decoding throughput of every protocol on a synthetic stream of barcodes,
+// fed to the decoder in blocks the size of a serial read.
+void protocolBenchmark()
+{
+    const char *samples[] =
+    {
+        "12345678",
+        "W-1234",
+        "H-9876",
+        "ATA-SN-5QF2J7BX",
+        "https://tarallo.weeeopen.it/item/R777",
+        "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    };
+
+    const int sampleCount = sizeof(samples) / sizeof(samples[0]);
+    const int streamSize = 1 << 20;
+    const int blockSize = 256;
+    const double minimumTime = 0.25;
+
+    unsigned char *stream = malloc(streamSize + PROTOCOL_MAX_FRAME + 6);
+    Decoder *decoder = malloc(sizeof *decoder);
+
+    if(stream == NULL || decoder == NULL)
+    {
+        LOG(LOG_ERROR, "Failed to allocate memory for the benchmark.");
+        free(stream);
+        free(decoder);
+        return;
+    }
+
+    printf("%-8s %12s %14s %10s\n", "Protocol", "MB/s", "Frames/s", "Corrupt");
+
+    for(int p = 0; p < protocolCount; ++p)
+    {
+        int length = 0;
+        int sent = 0;
+
+        while(length < streamSize)
+            length += protocolEncode(&protocols[p], samples[sent++ % sampleCount], stream + length);
+
+        decoderInitialize(decoder, &protocols[p]);
+
+        unsigned long frames = 0;
+        unsigned long rounds = 0;
+        double elapsed = 0;
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        do
+        {
+            for(int offset = 0; offset < length; offset += blockSize)
+                decoderFeed(decoder, stream + offset, (length - offset < blockSize) ? length - offset : blockSize, countFrame, &frames);
+
+            rounds++;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        }
+        while(elapsed < minimumTime);
+
+        if(frames != (unsigned long) sent * rounds)
+            LOG(LOG_ERROR, "Protocol %s decoded %lu frames out of %lu.", protocols[p].name, frames, (unsigned long) sent * rounds);
+
+        printf("%-8s %12.1f %14.0f %10lu\n", protocols[p].name, length * rounds / elapsed / 1e6, frames / elapsed, decoder->corrupt);
+    }
+
+    free(stream);
+    free(decoder);
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+
+// Longest payload accepted in a single frame. Longer frames are considered corrupt and discarded.
+#define PROTOCOL_MAX_FRAME 4096
+
+// Decoder states
+#define STATE_HUNT      0   // Waiting for the start of a frame
+#define STATE_DATA      1   // Collecting a delimited payload
+#define STATE_DISCARD   2   // Skipping the rest of a corrupt frame
+#define STATE_LENGTH    3   // Waiting for the length byte of a packet
+#define STATE_PAYLOAD   4   // Collecting a length-prefixed payload
+#define STATE_CHECKSUM  5   // Waiting for the block check character
+#define STATE_COUNT     6
+
+// Byte classes (computed once per protocol, indexed by the received byte)
+#define CLASS_OTHER     0
+#define CLASS_START     1
+#define CLASS_END       2
+#define CLASS_COUNT     3
+
+typedef struct
+{
+    unsigned char next;     // State to move to
+    unsigned char action;   // Action to perform on the byte
+} Transition;
+
+typedef struct
+{
+    const char *name;                               // Name passed to --protocol
+    const char *description;                        // One line shown in the help page
+    int start;                                      // Byte opening a frame, -1 if frames are not introduced by a marker
+    const char *ends;                               // Bytes closing a frame, NULL if frames are length-prefixed
+    int checksum;                                   // A XOR block check character closes the frame
+    int aimPrefix;                                  // Payloads start with an AIM symbology identifier ("]Cm") to strip
+    const Transition (*table)[CLASS_COUNT];         // Transition table, indexed by [state][class]
+} Protocol;
+
+typedef struct
+{
+    const Protocol *protocol;
+    unsigned char classes[256];     // Class of every possible byte for the selected protocol
+
+    int state;
+    int length;                     // Bytes of payload collected so far
+    int expected;                   // Declared payload length (length-prefixed protocols only)
+    unsigned char checksum;         // Running XOR of the checked bytes
+
+    unsigned long frames;           // Frames delivered
+    unsigned long corrupt;          // Frames discarded (bad checksum, overflow, missing prefix...)
+
+    char frame[PROTOCOL_MAX_FRAME + 1];
+} Decoder;
+
+// Called once for every complete frame. The frame is NUL-terminated and only valid during the call.
+typedef void (*FrameHandler)(char *frame, int length, void *context);
+
+extern const Protocol protocols[];
+extern const int protocolCount;
+
+const Protocol *protocolFind(const char *name);
+void decoderInitialize(Decoder *decoder, const Protocol *protocol);
+void decoderFeed(Decoder *decoder, const unsigned char *bytes, size_t count, FrameHandler handler, void *context);
+int protocolEncode(const Protocol *protocol, const char *payload, unsigned char *buffer);
+void protocolBenchmark();
\ No newline at end of file
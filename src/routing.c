@@ -0,0 +1,486 @@
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xatom.h>
+
+#include "common.h"
+#include "routing.h"
+
+int compileCondition(regex_t *expression, char *pattern);
+void addWindow(Display *display, WindowIndex *index, Window window);
+void removeWindow(WindowIndex *index, Window window);
+void describeWindow(Display *display, WindowIndex *index, IndexedWindow *entry);
+void forgetWindow(IndexedWindow *entry);
+void synchronizeClientList(Display *display, WindowIndex *index);
+int readClientList(Display *display, WindowIndex *index, Window **clients, unsigned long *count);
+int windowMatches(const RoutingRule *rule, IndexedWindow *entry);
+
+/*
+ *      Routing rules
+ *      =============
+ *
+ *      Rules are separated by ';' and made of conditions separated by ',':
+ *
+ *          barcode=<regex>     scans the rule applies to (all of them if missing)
+ *          class=<regex>       WM_CLASS (class or instance) of the target window
+ *          title=<regex>       title of the target window
+ *
+ *      Every rule needs at least one of class and title. Regular expressions are POSIX extended ones
+ *      and cannot contain ',' or ';'. The first rule matching both the scan and an existing window
+ *      wins, scans matching no rule are typed in the focused window.
+ */
+
+int routingParse(RoutingTable *table, char *string)
+{
+    if(string == NULL)
+        return OK;
+
+    char *rules = strdup(string);
+    char *ruleEnd;
+    int result = OK;
+
+    if(rules == NULL)
+        return FAILED;
+
+    for(char *text = strtok_r(rules, ";", &ruleEnd); text != NULL && result == OK; text = strtok_r(NULL, ";", &ruleEnd))
+    {
+        if(table->count == ROUTING_MAX_RULES)
+        {
+            LOG(LOG_ERROR, "  More than %d routing rules.", ROUTING_MAX_RULES);
+            result = FAILED;
+            break;
+        }
+
+        RoutingRule *rule = &table->rules[table->count];
+        char *conditionEnd;
+
+        memset(rule, 0, sizeof *rule);
+
+        for(char *condition = strtok_r(text, ",", &conditionEnd); condition != NULL && result == OK; condition = strtok_r(NULL, ",", &conditionEnd))
+        {
+            char *pattern = strchr(condition, '=');
+
+            if(pattern == NULL)
+            {
+                LOG(LOG_ERROR, "  \"%s\" is not a valid routing condition.", condition);
+                result = FAILED;
+                break;
+            }
+
+            *pattern++ = 0;
+
+            regex_t *expression = NULL;
+            int *present = NULL;
+
+            if(SAMESTR(condition, "barcode"))
+            {
+                expression = &rule->barcode;
+                present = &rule->hasBarcode;
+            }
+            else if(SAMESTR(condition, "class"))
+            {
+                expression = &rule->windowClass;
+                present = &rule->hasClass;
+            }
+            else if(SAMESTR(condition, "title"))
+            {
+                expression = &rule->title;
+                present = &rule->hasTitle;
+            }
+
+            if(present == NULL || *present)
+            {
+                LOG(LOG_ERROR, "  \"%s\" is not a valid routing condition or is repeated.", condition);
+                result = FAILED;
+                break;
+            }
+
+            if(compileCondition(expression, pattern) == FAILED)
+            {
+                result = FAILED;
+                break;
+            }
+
+            *present = TRUE;
+        }
+
+        if(result == OK && !rule->hasClass && !rule->hasTitle)
+        {
+            LOG(LOG_ERROR, "  Routing rule %d does not select any window.", table->count + 1);
+            result = FAILED;
+        }
+
+        // Count the rule even if incomplete, so that routingTerminate frees what has been compiled.
+        table->count++;
+    }
+
+    free(rules);
+
+    if(result == FAILED)
+        routingTerminate(table);
+
+    return result;
+}
+
+int compileCondition(regex_t *expression, char *pattern)
+{
+    int error = regcomp(expression, pattern, REG_EXTENDED | REG_NOSUB);
+
+    if(error != 0)
+    {
+        char message[128];
+
+        regerror(error, expression, message, sizeof message);
+        LOG(LOG_ERROR, "  \"%s\" is not a valid regular expression: %s", pattern, message);
+        return FAILED;
+    }
+
+    return OK;
+}
+
+int routingEnabled(const RoutingTable *table)
+{
+    return table->count > 0;
+}
+
+// Find the window a scan must be typed into. Returns None if the focused window must be used.
+// The caller keeps the index up to date with the events of the display (see windowIndexHandle); windows found
+// by a rule are cached until the index changes, so most scans cost a few regular expressions on the barcode alone.
+// The index is built the first time it is needed (routing can be enabled by a reload).
+// Without a barcode (typed blocks, which hold many) rules with a barcode condition are skipped.
+Window routingResolve(const RoutingTable *table, Display *display, WindowIndex *index, const char *barcode)
+{
+    if(!index->built && windowIndexBuild(display, index) == FAILED)
+    {
+        LOG(LOG_WARNING, "  Failed to index windows: typing in the focused window.");
+        return None;
+    }
+
+    // Windows cached for other rules mean nothing for these ones.
+    if(index->routedTable != table->generation)
+    {
+        memset(index->routedGenerations, 0, sizeof index->routedGenerations);
+        index->routedTable = table->generation;
+    }
+
+    for(int i = 0; i < table->count; ++i)
+    {
+        const RoutingRule *rule = &table->rules[i];
+
+        if(rule->hasBarcode && (barcode == NULL || regexec(&rule->barcode, barcode, 0, NULL, 0) != 0))
+            continue;
+
+        if(index->routedGenerations[i] != index->generation)
+        {
+            index->routedWindows[i] = None;
+            index->routedGenerations[i] = index->generation;
+
+            for(int j = 0; j < index->count; ++j)
+                if(windowMatches(rule, &index->windows[j]))
+                {
+                    index->routedWindows[i] = index->windows[j].window;
+                    break;
+                }
+        }
+
+        if(index->routedWindows[i] != None)
+        {
+            LOG(LOG_DEBUG, "  Scan matches routing rule %d: window 0x%08lX.", i + 1, index->routedWindows[i]);
+            return index->routedWindows[i];
+        }
+    }
+
+    return None;
+}
+
+// Missing properties only match expressions that match the empty string.
+int windowMatches(const RoutingRule *rule, IndexedWindow *entry)
+{
+    const char *windowClass = entry->windowClass ? entry->windowClass : "";
+    const char *instance = entry->instance ? entry->instance : "";
+    const char *title = entry->title ? entry->title : "";
+
+    if(rule->hasClass && regexec(&rule->windowClass, windowClass, 0, NULL, 0) != 0 && regexec(&rule->windowClass, instance, 0, NULL, 0) != 0)
+        return FALSE;
+
+    if(rule->hasTitle && regexec(&rule->title, title, 0, NULL, 0) != 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+void routingTerminate(RoutingTable *table)
+{
+    for(int i = 0; i < table->count; ++i)
+    {
+        if(table->rules[i].hasBarcode)
+            regfree(&table->rules[i].barcode);
+
+        if(table->rules[i].hasClass)
+            regfree(&table->rules[i].windowClass);
+
+        if(table->rules[i].hasTitle)
+            regfree(&table->rules[i].title);
+    }
+
+    table->count = 0;
+}
+
+// Index the top-level windows of the display. This is the only time the window tree may be walked:
+// from then on the index follows the events the server sends (see windowIndexHandle).
+int windowIndexBuild(Display *display, WindowIndex *index)
+{
+    Window root = DefaultRootWindow(display);
+    Window *clients;
+    unsigned long count;
+
+    windowIndexClear(index);
+
+    index->clientList = XInternAtom(display, "_NET_CLIENT_LIST", False);
+    index->windowName = XInternAtom(display, "_NET_WM_NAME", False);
+    index->utf8String = XInternAtom(display, "UTF8_STRING", False);
+
+    // Get told about windows being created or destroyed and about changes of the client list.
+    XSelectInput(display, root, SubstructureNotifyMask | PropertyChangeMask);
+
+    if(readClientList(display, index, &clients, &count))
+    {
+        index->ewmh = TRUE;
+
+        for(unsigned long i = 0; i < count; ++i)
+            addWindow(display, index, clients[i]);
+
+        XFree(clients);
+    }
+    else
+    {
+        Window parent;
+        unsigned int children;
+
+        if(!XQueryTree(display, root, &root, &parent, &clients, &children))
+        {
+            LOG(LOG_ERROR, "  Failed to list the top-level windows.");
+            return FAILED;
+        }
+
+        for(unsigned int i = 0; i < children; ++i)
+            addWindow(display, index, clients[i]);
+
+        if(clients != NULL)
+            XFree(clients);
+    }
+
+    index->built = TRUE;
+
+    LOG(LOG_DEBUG, "  Indexed %d windows (%s).", index->count, index->ewmh ? "_NET_CLIENT_LIST" : "children of the root window");
+    return OK;
+}
+
+// Apply an event of the display to the index. Events about windows that are not indexed are ignored.
+void windowIndexHandle(Display *display, WindowIndex *index, XEvent *event)
+{
+    Window root = DefaultRootWindow(display);
+
+    if(!index->built)
+        return;
+
+    switch(event->type)
+    {
+        case CreateNotify:
+            // Window managers supporting EWMH tell which new windows are clients: wait for them to do so.
+            if(!index->ewmh && event->xcreatewindow.parent == root)
+                addWindow(display, index, event->xcreatewindow.window);
+            break;
+
+        case DestroyNotify:
+            removeWindow(index, event->xdestroywindow.window);
+            break;
+
+        case PropertyNotify:
+            if(event->xproperty.window == root)
+            {
+                if(event->xproperty.atom == index->clientList)
+                {
+                    index->ewmh = TRUE;
+                    synchronizeClientList(display, index);
+                }
+            }
+            else if(event->xproperty.atom == XA_WM_CLASS || event->xproperty.atom == XA_WM_NAME || event->xproperty.atom == index->windowName)
+            {
+                for(int i = 0; i < index->count; ++i)
+                    if(index->windows[i].window == event->xproperty.window)
+                    {
+                        describeWindow(display, index, &index->windows[i]);
+                        index->generation++;
+                        break;
+                    }
+            }
+            break;
+    }
+}
+
+// Stop following the windows (routing has been disabled by a reload) and forget them.
+void windowIndexRelease(Display *display, WindowIndex *index)
+{
+    if(!index->built)
+        return;
+
+    for(int i = 0; i < index->count; ++i)
+        XSelectInput(display, index->windows[i].window, NoEventMask);
+
+    XSelectInput(display, DefaultRootWindow(display), NoEventMask);
+    windowIndexClear(index);
+
+    LOG(LOG_DEBUG, "  Routing disabled: no longer following the windows of the display.");
+}
+
+void windowIndexClear(WindowIndex *index)
+{
+    for(int i = 0; i < index->count; ++i)
+        forgetWindow(&index->windows[i]);
+
+    free(index->windows);
+
+    index->windows = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->built = FALSE;
+    index->ewmh = FALSE;
+    index->generation++;
+}
+
+// Add and remove windows so that the index matches the client list published by the window manager.
+void synchronizeClientList(Display *display, WindowIndex *index)
+{
+    Window *clients;
+    unsigned long count;
+
+    if(!readClientList(display, index, &clients, &count))
+        return;
+
+    for(int i = index->count - 1; i >= 0; --i)
+    {
+        int listed = FALSE;
+
+        for(unsigned long j = 0; j < count && !listed; ++j)
+            listed = (clients[j] == index->windows[i].window);
+
+        if(!listed)
+            removeWindow(index, index->windows[i].window);
+    }
+
+    for(unsigned long i = 0; i < count; ++i)
+        addWindow(display, index, clients[i]);
+
+    XFree(clients);
+}
+
+int readClientList(Display *display, WindowIndex *index, Window **clients, unsigned long *count)
+{
+    Atom type;
+    int format;
+    unsigned long remaining;
+    unsigned char *data = NULL;
+
+    if(XGetWindowProperty(display, DefaultRootWindow(display), index->clientList, 0, 1024, False, XA_WINDOW,
+                          &type, &format, count, &remaining, &data) != Success || type != XA_WINDOW || format != 32)
+    {
+        if(data != NULL)
+            XFree(data);
+
+        return FALSE;
+    }
+
+    *clients = (Window *) data;
+    return TRUE;
+}
+
+void addWindow(Display *display, WindowIndex *index, Window window)
+{
+    for(int i = 0; i < index->count; ++i)
+        if(index->windows[i].window == window)
+            return;
+
+    if(index->count == index->capacity)
+    {
+        int capacity = index->capacity ? 2 * index->capacity : 32;
+        IndexedWindow *windows = realloc(index->windows, capacity * sizeof(IndexedWindow));
+
+        if(windows == NULL)
+        {
+            LOG(LOG_ERROR, "  Failed to expand memory for the window index.");
+            return;
+        }
+
+        index->windows = windows;
+        index->capacity = capacity;
+    }
+
+    IndexedWindow *entry = &index->windows[index->count++];
+
+    memset(entry, 0, sizeof *entry);
+    entry->window = window;
+
+    // Get told when the window changes title or class, or goes away.
+    XSelectInput(display, window, PropertyChangeMask | StructureNotifyMask);
+    describeWindow(display, index, entry);
+
+    index->generation++;
+}
+
+void removeWindow(WindowIndex *index, Window window)
+{
+    for(int i = 0; i < index->count; ++i)
+        if(index->windows[i].window == window)
+        {
+            forgetWindow(&index->windows[i]);
+
+            index->windows[i] = index->windows[--index->count];
+            index->generation++;
+            return;
+        }
+}
+
+// Read class and title of a window. Missing properties are left NULL.
+void describeWindow(Display *display, WindowIndex *index, IndexedWindow *entry)
+{
+    XClassHint hint;
+    Atom type;
+    int format;
+    unsigned long length, remaining;
+    unsigned char *name = NULL;
+    char *legacyName = NULL;
+
+    forgetWindow(entry);
+
+    if(XGetClassHint(display, entry->window, &hint))
+    {
+        entry->windowClass = hint.res_class ? strdup(hint.res_class) : NULL;
+        entry->instance = hint.res_name ? strdup(hint.res_name) : NULL;
+
+        XFree(hint.res_class);
+        XFree(hint.res_name);
+    }
+
+    if(XGetWindowProperty(display, entry->window, index->windowName, 0, 1024, False, index->utf8String,
+                          &type, &format, &length, &remaining, &name) == Success && type == index->utf8String && name != NULL)
+        entry->title = strdup((char *) name);
+    else if(XFetchName(display, entry->window, &legacyName) && legacyName != NULL)
+        entry->title = strdup(legacyName);
+
+    if(name != NULL)
+        XFree(name);
+
+    if(legacyName != NULL)
+        XFree(legacyName);
+}
+
+void forgetWindow(IndexedWindow *entry)
+{
+    free(entry->windowClass);
+    free(entry->instance);
+    free(entry->title);
+
+    entry->windowClass = NULL;
+    entry->instance = NULL;
+    entry->title = NULL;
+}
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <regex.h>
+#include <X11/Xlib.h>
+
+// Longest routing rule list accepted on the command line.
+#define ROUTING_MAX_RULES 16
+
+typedef struct
+{
+    Window window;
+    char *windowClass;          // WM_CLASS class and instance (NULL if missing)
+    char *instance;
+    char *title;                // _NET_WM_NAME, or WM_NAME if the former is missing (NULL if both are)
+} IndexedWindow;
+
+// Top-level windows of a display, kept up to date by the events the server sends about them.
+// Generations start from 1, so that no cached window is valid before the index is built.
+typedef struct
+{
+    IndexedWindow *windows;
+    int count;
+    int capacity;
+
+    int built;                  // The index has been built and follows the events of the display
+    int ewmh;                   // The window manager publishes _NET_CLIENT_LIST
+    unsigned long generation;   // Incremented on every change, invalidates the routing cache
+
+    Window routedWindows[ROUTING_MAX_RULES];            // Last window found for each rule...
+    unsigned long routedGenerations[ROUTING_MAX_RULES]; // ...valid until the index changes...
+    unsigned long routedTable;                          // ...or the rules are reloaded.
+
+    Atom clientList;
+    Atom windowName;
+    Atom utf8String;
+} WindowIndex;
+
+typedef struct
+{
+    regex_t barcode;            // Scans the rule applies to
+    regex_t windowClass;        // Target window (WM_CLASS class or instance)...
+    regex_t title;              // ...and its title
+    int hasBarcode;
+    int hasClass;
+    int hasTitle;
+} RoutingRule;
+
+// Rules, as read from the command line or the configuration file.
+typedef struct
+{
+    RoutingRule rules[ROUTING_MAX_RULES];
+    int count;
+    unsigned long generation;   // Tells the caches of the window indexes which table filled them (never 0)
+} RoutingTable;
+
+int routingParse(RoutingTable *table, char *string);
+int routingEnabled(const RoutingTable *table);
+Window routingResolve(const RoutingTable *table, Display *display, WindowIndex *index, const char *barcode);
+void routingTerminate(RoutingTable *table);
+
+int windowIndexBuild(Display *display, WindowIndex *index);
+void windowIndexHandle(Display *display, WindowIndex *index, XEvent *event);
+void windowIndexRelease(Display *display, WindowIndex *index);
+void windowIndexClear(WindowIndex *index);
\ No newline at end of file
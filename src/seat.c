@@ -0,0 +1,488 @@
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#include "common.h"
+#include "seat.h"
+#include "pacing.h"
+
+void *seatRun(void *data);
+int seatType(Seat *seat);
+int seatCollect(Seat *seat, char *string);
+void seatToggleSession(Seat *seat);
+void seatSubmit(Seat *seat);
+void seatRecord(Seat *seat, struct timespec *received);
+void seatPin(Seat *seat);
+void seatUnpin(Seat *seat);
+void serverName(const char *displayName, char *name, int size);
+
+/*
+ *  IMPORTANT NOTICE
+ *
+ *  Every seat owns its serial device and its X11 context: the threads share nothing but the settings, which
+ *  a seat only pins from the moment a frame has been decoded until its scan has been typed (never while it
+ *  waits for or reads from the scanner, so that a reload can free the previous settings as soon as the scans
+ *  typed with them are done). A slow application on one display
+ *  therefore never delays the scans of the others.
+ *
+ *  Seat threads are never cancelled. When the stop descriptor becomes readable they stop reading from the
+ *  scanner, type the barcodes that have already been received (terminator included) and return, writing
+ *  to the stopped descriptor so that the main thread can join them without polling.
+ *
+ *  During an intake session scans are only counted in the batch of the seat, which goes out as a single
+ *  block, file write or socket message when the session ends. The per-scan cost (focus lookup, keystrokes,
+ *  terminator, the form processing every submission) is paid once per session instead.
+ */
+
+// Parse a "<device>=<display>" description. The display can be omitted ("<device>" or "<device>=") to use $DISPLAY.
+int seatParse(Seat *seat, char *description)
+{
+    memset(seat, 0, sizeof *seat);
+
+    // Nothing to close until seatStart opens them.
+    seat->sessionFD = FAILED;
+    seat->eventsFD = FAILED;
+
+    if(description == NULL || description[0] == '=' || description[0] == 0)
+        return FAILED;
+
+    seat->devicePath = description;
+
+    char *separator = strchr(description, '=');
+
+    if(separator != NULL)
+    {
+        *separator = 0;
+
+        if(separator[1] != 0)
+            seat->displayName = separator + 1;
+    }
+
+    return OK;
+}
+
+// Whether two seats type into the same X server, whatever the screen. The keyboard mapping belongs to the server:
+// each seat would rebind the spare keycodes of the other and type its characters.
+int seatSharesDisplay(Seat *seat, Seat *other)
+{
+    char one[256], two[256];
+
+    serverName(seat->displayName, one, sizeof one);
+    serverName(other->displayName, two, sizeof two);
+
+    return strcmp(one, two) == 0;
+}
+
+// "[host]:<display>" without the screen, the local host ("unix") left out.
+void serverName(const char *displayName, char *name, int size)
+{
+    const char *display = XDisplayName(displayName);
+    const char *colon = strrchr(display, ':');
+
+    if(colon == NULL)
+    {
+        snprintf(name, size, "%s", display);
+        return;
+    }
+
+    int hostLength = colon - display;
+
+    if(hostLength == 4 && strncmp(display, "unix", 4) == 0)
+        hostLength = 0;
+
+    snprintf(name, size, "%.*s%.*s", hostLength, display, (int) strcspn(colon, "."), colon);
+}
+
+// Open the scanner and the display of the seat and start typing its scans in a new thread.
+int seatStart(Seat *seat, int setSerial, const Protocol *protocol, int stopFD, int stoppedFD)
+{
+    LOG(LOG_INFO, "Starting seat %s => %s...", seat->devicePath, XDisplayName(seat->displayName));
+
+    if(X11Initialize(&seat->x, seat->displayName) == FAILED)
+    {
+        LOG(LOG_ERROR, "  Failed to initialize X11 for display %s.", XDisplayName(seat->displayName));
+        return FAILED;
+    }
+
+    if(serialInitialize(&seat->serial, seat->devicePath, setSerial, protocol) != OK)
+    {
+        LOG(LOG_ERROR, "  Failed to open serial connection to device %s.", seat->devicePath);
+        return FAILED;
+    }
+
+    seat->stopFD = stopFD;
+    seat->stoppedFD = stoppedFD;
+
+    // The thread waits on the scanner and on a single descriptor telling it to stop or to toggle the session.
+    struct epoll_event stop = { EPOLLIN, { .fd = stopFD } };
+    struct epoll_event session = { EPOLLIN, { .fd = 0 } };
+
+    if((seat->sessionFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == FAILED
+        || (seat->eventsFD = epoll_create1(EPOLL_CLOEXEC)) == FAILED
+        || epoll_ctl(seat->eventsFD, EPOLL_CTL_ADD, stopFD, &stop) == FAILED
+        || (session.data.fd = seat->sessionFD, epoll_ctl(seat->eventsFD, EPOLL_CTL_ADD, seat->sessionFD, &session)) == FAILED)
+    {
+        LOG(LOG_ERROR, "  Failed to create the event descriptors of the seat.");
+        LOG(LOG_ERROR, "      The error was: %s", strerror(errno));
+        return FAILED;
+    }
+
+    // Signals are handled by the main thread only.
+    sigset_t signals, previous;
+
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+    int result = pthread_create(&seat->thread, NULL, seatRun, seat);
+
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if(result != 0)
+    {
+        LOG(LOG_ERROR, "  Failed to start the seat thread.");
+        LOG(LOG_ERROR, "      The error was: %s", strerror(result));
+        return FAILED;
+    }
+
+    seat->running = TRUE;
+
+    LOG(LOG_INFO, "Seat %s started!", seat->devicePath);
+    return OK;
+}
+
+// Body of the seat threads: read scans from the device and type them until the device is closed or the seat is stopped.
+void *seatRun(void *data)
+{
+    Seat *seat = data;
+    struct pollfd stop = { seat->stopFD, POLLIN, 0 };
+    uint64_t toggles;
+
+    profileStart(&seat->profiler, seat->devicePath);
+
+    while(TRUE)
+    {
+        seatPin(seat);
+        X11Poll(&seat->x);
+        seatUnpin(seat);
+
+        // While the display is not available, wake up regularly to reconnect and type the queued scans.
+        if(serialWait(&seat->serial, X11Connected(&seat->x) ? -1 : X11_RETRY_INTERVAL, seat->eventsFD))
+        {
+            if(seatType(seat) == FAILED)
+                break;
+        }
+        else if(poll(&stop, 1, 0) > 0)
+        {
+            if(seat->serial.pendingCount > 0)
+                LOG(LOG_INFO, "Seat %s stopping: typing %d barcodes already received.", seat->devicePath, seat->serial.pendingCount);
+
+            // Barcodes already decoded never touch the device again.
+            while(seat->serial.pendingCount > 0)
+                seatType(seat);
+
+            // Scans collected so far are not lost with the session.
+            if(seat->batch.count > 0)
+            {
+                seatPin(seat);
+                seatSubmit(seat);
+                seatUnpin(seat);
+            }
+
+            break;
+        }
+        // Toggles are handled between reads, even while the scanner has only sent part of a frame.
+        else if(read(seat->sessionFD, &toggles, sizeof toggles) == sizeof toggles && toggles % 2 == 1)
+        {
+            seatPin(seat);
+            seatToggleSession(seat);
+            seatUnpin(seat);
+        }
+    }
+
+    profileStop(&seat->profiler);
+
+    uint64_t one = 1;
+
+    __atomic_store_n(&seat->finished, TRUE, __ATOMIC_RELEASE);
+
+    if(write(seat->stoppedFD, &one, sizeof one) != sizeof one)
+        LOG(LOG_ERROR, "Failed to notify the end of seat %s.", seat->devicePath);
+
+    return NULL;
+}
+
+// Read a barcode and type it. Returns OK without typing while the frame is incomplete; fails only if the scanner has been lost.
+int seatType(Seat *seat)
+{
+    struct timespec received;
+
+    profileEnter(PROFILE_READ);
+    char *string = readBarcode(&seat->serial, &received);
+    profileLeave(PROFILE_READ);
+
+    if(string == NULL && !seat->serial.lost)
+        return OK;
+
+    if(string == NULL)
+    {
+        LOG(LOG_FATAL, "ERROR: Lost the scanner of seat %s.", seat->devicePath);
+        return FAILED;
+    }
+
+    // The whole scan is handled with the same settings, pinned only once its frame has been decoded.
+    seatPin(seat);
+
+    // Scans of an intake session, and control barcodes, are not typed one by one.
+    if(seatCollect(seat, string))
+    {
+        seatUnpin(seat);
+        profileScan(&seat->profiler, string);
+        free(string);
+        return OK;
+    }
+
+    profileEnter(PROFILE_TYPE);
+    int result = typeString(&seat->x, string, 0);
+    profileLeave(PROFILE_TYPE);
+
+    // Scans queued while the display is not available have not reached the operator: they get the error feedback.
+    if(result == FAILED)
+    {
+        LOG(LOG_ERROR, "ERROR: Failed to print the string on seat %s.", seat->devicePath);
+        seat->failures++;
+        serialSend(&seat->serial, &seat->x.settings->nack, NULL);
+    }
+    else if(seat->x.queuedCount > 0)
+    {
+        seat->queued++;
+        serialSend(&seat->serial, &seat->x.settings->nack, NULL);
+    }
+    else
+    {
+        seatRecord(seat, &received);
+        serialSend(&seat->serial, &seat->x.settings->ack, &received);
+    }
+
+    seatUnpin(seat);
+    profileScan(&seat->profiler, string);
+
+    // This string has been malloc'd
+    free(string);
+    return OK;
+}
+
+// Handle the control barcodes and collect the scans of an intake session. Returns TRUE if the scan must not be typed.
+int seatCollect(Seat *seat, char *string)
+{
+    const Settings *settings = seat->x.settings;
+    int start = settings->sessionStart[0] != 0 && strcmp(string, settings->sessionStart) == 0;
+    int end = settings->sessionEnd[0] != 0 && strcmp(string, settings->sessionEnd) == 0;
+
+    // The same control barcode can both start and end the session.
+    if((start && !seat->session) || (end && seat->session))
+    {
+        seatToggleSession(seat);
+        return TRUE;
+    }
+
+    // Retry a batch that could not be submitted.
+    if(end && seat->batch.count > 0)
+    {
+        seatSubmit(seat);
+        return TRUE;
+    }
+
+    if(start || end)
+    {
+        LOG(LOG_INFO, "Seat %s: ignoring control barcode \"%s\".", seat->devicePath, string);
+        return TRUE;
+    }
+
+    if(!seat->session)
+        return FALSE;
+
+    // A full batch goes out on its own and the session goes on.
+    if(seat->batch.count == BATCH_MAX_ENTRIES)
+        seatSubmit(seat);
+
+    int count = batchAdd(&seat->batch, string);
+
+    if(count == FAILED)
+    {
+        LOG(LOG_ERROR, "Failed to allocate memory to collect \"%s\" on seat %s: typing it.", string, seat->devicePath);
+        return FALSE;
+    }
+
+    LOG(LOG_DEBUG, "Collected \"%s\" on seat %s (%d times, %d distinct barcodes).", string, seat->devicePath, count, seat->batch.count);
+    serialSend(&seat->serial, &settings->ack, NULL);
+    return TRUE;
+}
+
+// Start collecting scans or, if a session is open, submit them.
+void seatToggleSession(Seat *seat)
+{
+    if(seat->session)
+    {
+        seat->session = FALSE;
+        seatSubmit(seat);
+        return;
+    }
+
+    LOG(LOG_INFO, "Seat %s: intake session started.", seat->devicePath);
+    seat->session = TRUE;
+    serialSend(&seat->serial, &seat->x.settings->ack, NULL);
+}
+
+// Send the batch where the settings say. On failure the batch is kept for the next submission.
+void seatSubmit(Seat *seat)
+{
+    const Settings *settings = seat->x.settings;
+    Batch *batch = &seat->batch;
+
+    if(batch->count == 0)
+    {
+        LOG(LOG_INFO, "Seat %s: intake session ended without scans.", seat->devicePath);
+        return;
+    }
+
+    char *text = batchFormat(batch, settings->sessionFormat, seat->devicePath);
+    int result = FAILED;
+
+    if(text == NULL)
+        LOG(LOG_ERROR, "Failed to allocate memory to format the batch of seat %s.", seat->devicePath);
+    else if(settings->sessionOutput == BATCH_TYPE)
+    {
+        profileEnter(PROFILE_TYPE);
+        result = typeBlock(&seat->x, text);
+        profileLeave(PROFILE_TYPE);
+    }
+    else
+        result = batchWrite(settings->sessionOutput, settings->sessionPath, text);
+
+    free(text);
+
+    if(result == FAILED)
+    {
+        LOG(LOG_ERROR, "ERROR: Failed to submit the %lu scans collected on seat %s: keeping them.", batch->scans, seat->devicePath);
+        seat->submitFailures++;
+        serialSend(&seat->serial, &settings->nack, NULL);
+        return;
+    }
+
+    LOG(LOG_INFO, "Seat %s: submitted %lu scans of %d distinct barcodes.", seat->devicePath, batch->scans, batch->count);
+    seat->sessions++;
+    seat->batched += batch->scans;
+    batchClear(batch);
+    serialSend(&seat->serial, &settings->ack, NULL);
+}
+
+// Ask the seat thread to start an intake session or to submit the one in progress (SIGUSR1).
+void seatRequestSession(Seat *seat)
+{
+    uint64_t one = 1;
+
+    if(seat->running && write(seat->sessionFD, &one, sizeof one) != sizeof one)
+        LOG(LOG_ERROR, "Failed to toggle the intake session of seat %s.", seat->devicePath);
+}
+
+// Account for a scan typed as soon as it was read.
+void seatRecord(Seat *seat, struct timespec *received)
+{
+    long latency = microsecondsSince(received);
+
+    if(seat->scans == 0 || latency < seat->latencyMinimum)
+        seat->latencyMinimum = latency;
+
+    if(latency > seat->latencyMaximum)
+        seat->latencyMaximum = latency;
+
+    seat->latencyTotal += latency;
+    seat->scans++;
+
+    LOG(LOG_DEBUG, "Scan typed on seat %s in %ld us.", seat->devicePath, latency);
+}
+
+// Whether the seat thread has stopped (because it was asked to or because the scanner was lost).
+int seatStopped(Seat *seat)
+{
+    // The thread is about to return: joining it does not block for long.
+    if(seat->running && __atomic_load_n(&seat->finished, __ATOMIC_ACQUIRE))
+    {
+        pthread_join(seat->thread, NULL);
+        seat->running = FALSE;
+    }
+
+    return !seat->running;
+}
+
+// Print the statistics of the seat. Only meaningful once the seat thread has stopped.
+void seatReport(Seat *seat)
+{
+    SerialDevice *serial = &seat->serial;
+
+    if(seat->scans == 0)
+        printf("%-16s => %-12s: no scans typed, %lu queued, %lu failed.\n", seat->devicePath, XDisplayName(seat->displayName), seat->queued, seat->failures);
+    else
+        printf("%-16s => %-12s: %lu scans typed, %lu queued, %lu failed, latency %ld us min, %ld us avg, %ld us max.\n",
+            seat->devicePath, XDisplayName(seat->displayName), seat->scans, seat->queued, seat->failures,
+            seat->latencyMinimum, seat->latencyTotal / (long) seat->scans, seat->latencyMaximum);
+
+    if(seat->sessions + seat->submitFailures > 0)
+        printf("%-32s  %lu scans submitted in %lu batches, %lu submissions failed.\n", "", seat->batched, seat->sessions, seat->submitFailures);
+
+    if(serial->commandsSent + serial->commandsDropped == 0)
+        return;
+
+    printf("%-32s  %lu commands sent to the scanner, %lu dropped", "", serial->commandsSent, serial->commandsDropped);
+
+    if(serial->feedbacks > 0)
+        printf(", acknowledged %ld us min, %ld us avg, %ld us max after the frame", serial->feedbackMinimum,
+            serial->feedbackTotal / (long) serial->feedbacks, serial->feedbackMaximum);
+
+    printf(".\n");
+}
+
+// Close the scanner and the display of a stopped seat.
+// A seat still typing (its shutdown deadline expired) is left alone: its display is in use.
+void seatTerminate(Seat *seat)
+{
+    if(!seatStopped(seat))
+    {
+        LOG(LOG_WARNING, "Seat %s is still typing: not closing it.", seat->devicePath);
+        return;
+    }
+
+    if(seat->batch.count > 0)
+    {
+        LOG(LOG_WARNING, "  %lu scans collected on seat %s were never submitted:", seat->batch.scans, seat->devicePath);
+
+        for(int i = 0; i < seat->batch.count; ++i)
+            LOG(LOG_WARNING, "    \"%s\" (%lu times)", seat->batch.entries[i].barcode, seat->batch.entries[i].count);
+    }
+
+    serialTerminate(&seat->serial);
+    X11Terminate(&seat->x);
+    batchTerminate(&seat->batch);
+
+    if(seat->eventsFD != FAILED)
+        close(seat->eventsFD);
+
+    if(seat->sessionFD != FAILED)
+        close(seat->sessionFD);
+}
+
+// Use the current settings until seatUnpin(): a reload will not free them in the meantime.
+void seatPin(Seat *seat)
+{
+    seat->x.settings = settingsAcquire(seat->reader);
+}
+
+void seatUnpin(Seat *seat)
+{
+    settingsRelease(seat->reader);
+    seat->x.settings = NULL;
+}
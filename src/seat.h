@@ -0,0 +1,55 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "batch.h"
+#include "profile.h"
+#include "protocol.h"
+#include "serial.h"
+#include "xorg.h"
+
+// Most scanners a single process can serve.
+#define SEAT_MAX SETTINGS_MAX_READERS
+
+// A scanner and the display its scans are typed into. Every seat runs in its own thread.
+typedef struct
+{
+    char *devicePath;                   // Scanner device
+    char *displayName;                  // Display to type into (NULL for $DISPLAY)
+    int reader;                         // Settings reader slot of the seat thread
+
+    SerialDevice serial;
+    X11Context x;
+
+    pthread_t thread;
+    int running;
+    int finished;                       // Set by the seat thread right before returning
+    int stopFD;                         // Readable when the seat must stop
+    int stoppedFD;                      // Written when the seat thread stops
+    int sessionFD;                      // Written to open or submit the intake session (SIGUSR1)
+    int eventsFD;                       // epoll of the two above, waited on with the scanner
+
+    int session;                        // Whether scans are collected into the batch instead of typed
+    Batch batch;
+
+    unsigned long scans;                // Scans typed as soon as they were read...
+    unsigned long queued;               // ...scans queued while the display was not available...
+    unsigned long failures;             // ...and scans that could not be typed.
+    long latencyTotal;                  // Microseconds from the end of the frame to the last keystroke...
+    long latencyMinimum;
+    long latencyMaximum;
+
+    unsigned long sessions;             // Batches submitted...
+    unsigned long batched;              // ...the scans they held...
+    unsigned long submitFailures;       // ...and submissions that failed (the batch is kept).
+
+    Profiler profiler;                  // Counters of the seat thread (--profile)
+} Seat;
+
+int seatParse(Seat *seat, char *description);
+int seatSharesDisplay(Seat *seat, Seat *other);
+int seatStart(Seat *seat, int setSerial, const Protocol *protocol, int stopFD, int stoppedFD);
+int seatStopped(Seat *seat);
+void seatRequestSession(Seat *seat);
+void seatReport(Seat *seat);
+void seatTerminate(Seat *seat);
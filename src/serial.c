@@ -1,97 +1,110 @@
+#include <ctype.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <termios.h>
 
+#include <time.h>
+
 #include "common.h"
+#include "serial.h"
+#include "pacing.h"
 
-int deviceFD = FAILED;      // File descriptor for scanner.
-FILE *deviceFS = NULL;      // File stream for scanner.
-struct termios deviceTTY;   // Serial device for scanner.
+// Size of a single read from the device.
+#define SERIAL_BLOCK_SIZE 256
 
-int initializedFD = FALSE;
-int initializedFS = FALSE;
+// Milliseconds given to the device to accept the last commands when closing it.
+#define SERIAL_FLUSH_TIMEOUT 100
 
-int serialTerminate();
 void dumpSerialParameters(struct termios *device);
-
-int serialInitializationDirty = FALSE;
-int serialInitializationComplete = FALSE;
+void queueBarcode(char *frame, int length, void *context);
+void dropCommands(SerialDevice *scanner);
 
 // Preapre and configure the scanner.
 // TODO: How many of the errno "decorated" functions actually set errno upon a fail?
-int serialInitialize(char *path, int setSerial)
+int serialInitialize(SerialDevice *scanner, char *path, int setSerial, const Protocol *protocol)
 {
     LOG(LOG_INFO, "Initializing serial connection...");
 
     // If the initialization has already been completed, do nothing
-    if(serialInitializationComplete)
+    if(scanner->initializationComplete)
     {
         LOG(LOG_DEBUG, "  Skipping initialization: already complete.");
         LOG(LOG_DEBUG, "  If you want to reinitialize serial, terminate it first.");
         return OK;
     }
 
-    if(serialInitializationDirty)
+    if(scanner->initializationDirty)
         LOG(LOG_WARNING, "  Previous serial initialization attempt did not complete successfully.");
 
     // We clear this value when we complete initialization. This way we know if a previous attempt failed.
-    serialInitializationDirty = TRUE;
+    scanner->initializationDirty = TRUE;
+
+    // Commands are written to the scanner without blocking: reads wait for the device with poll instead.
+    scanner->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+    // Users allowed to read the device but not to write to it can still scan, without feedback.
+    if(scanner->fd == FAILED && errno == EACCES && (scanner->fd = open(path, O_RDONLY | O_NOCTTY | O_NONBLOCK)) != FAILED)
+    {
+        LOG(LOG_WARNING, "  Device %s can only be read: no feedback will be sent to the scanner.", path);
+        scanner->readOnly = TRUE;
+    }
 
-    if((deviceFD = open(path, O_RDONLY)) == FAILED)
+    if(scanner->fd == FAILED)
     {
         LOG(LOG_ERROR, "  Failed to open file descriptor for device %s.", path);
         LOG(LOG_ERROR, "      The error was: %s", strerror(errno));
-        return serialTerminate();
+        return serialTerminate(scanner);
     }
 
     LOG(LOG_DEBUG, "  File descriptor for device %s opened successfully.", path);
-    initializedFD = TRUE;
+    scanner->initializedFD = TRUE;
 
-    if((deviceFS = fdopen(deviceFD, "r")) == NULL)
+    if((scanner->stream = fdopen(scanner->fd, "r")) == NULL)
     {
         LOG(LOG_ERROR, "  Failed to open file stream for device %s.\n    The error was: %s\n", path, strerror(errno));
-        return serialTerminate();
+        return serialTerminate(scanner);
     }
 
     LOG(LOG_DEBUG, "  File stream for device %s opened successfully.", path);
-    initializedFS = TRUE;
+    scanner->initializedFS = TRUE;
 
-    memset(&deviceTTY, 0, sizeof deviceTTY);
+    memset(&scanner->tty, 0, sizeof scanner->tty);
 
     // Get serial device configuration.
-    if(tcgetattr(deviceFD, &deviceTTY) == FAILED)
+    if(tcgetattr(scanner->fd, &scanner->tty) == FAILED)
     {
         LOG(LOG_ERROR, "  Failed to read serial parameters.\n    The error was: %s\n", strerror(errno));
-        return serialTerminate();
+        return serialTerminate(scanner);
     }
 
     LOG(LOG_DEBUG, "  Serial parameters read successfully.");
 
-    dumpSerialParameters(&deviceTTY);
+    dumpSerialParameters(&scanner->tty);
 
     if(setSerial)
     {
         // Configure connection parameters.
-        deviceTTY.c_cflag &= ~(ICANON|PARENB|CSTOPB|CRTSCTS|IXON|IXOFF|IXANY);
-        deviceTTY.c_cflag |=  (CS8|CLOCAL);
+        scanner->tty.c_cflag &= ~(ICANON|PARENB|CSTOPB|CRTSCTS|IXON|IXOFF|IXANY);
+        scanner->tty.c_cflag |=  (CS8|CLOCAL);
 
-        deviceTTY.c_iflag &= ~(ISIG|ECHO|ICANON|IEXTEN|IGNBRK|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL);
-        deviceTTY.c_iflag |=  (BRKINT|IGNPAR);
+        scanner->tty.c_iflag &= ~(ISIG|ECHO|ICANON|IEXTEN|IGNBRK|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL);
+        scanner->tty.c_iflag |=  (BRKINT|IGNPAR);
 
-	    deviceTTY.c_oflag &= ~(ISIG|ECHO|ICANON|IEXTEN|OPOST|ONLCR);
+	    scanner->tty.c_oflag &= ~(ISIG|ECHO|ICANON|IEXTEN|OPOST|ONLCR);
 
-        deviceTTY.c_lflag &= ~(ISIG|ECHO|ICANON|IEXTEN);
+        scanner->tty.c_lflag &= ~(ISIG|ECHO|ICANON|IEXTEN);
 
         // Wait for one character at least
-        deviceTTY.c_cc[VTIME] = 0;
-        deviceTTY.c_cc[VMIN] = 1;
+        scanner->tty.c_cc[VTIME] = 0;
+        scanner->tty.c_cc[VMIN] = 1;
 
-	    cfsetispeed(&deviceTTY, B19200);
-	    cfsetospeed(&deviceTTY, B19200);
+	    cfsetispeed(&scanner->tty, B19200);
+	    cfsetospeed(&scanner->tty, B19200);
 
-        if(tcsetattr(deviceFD, TCSANOW, &deviceTTY) == FAILED)
+        if(tcsetattr(scanner->fd, TCSANOW, &scanner->tty) == FAILED)
         {
             LOG(LOG_ERROR, "  Failed to set serial parameters.\n    The error was: %s\n", strerror(errno));
-            return serialTerminate();
+            return serialTerminate(scanner);
         }
 
         LOG(LOG_DEBUG, "  Serial parameters set successfully.");
@@ -99,101 +112,288 @@ int serialInitialize(char *path, int setSerial)
     else
         LOG(LOG_INFO, "  Skipping setting serial parameters...");
 
-    dumpSerialParameters(&deviceTTY);
+    dumpSerialParameters(&scanner->tty);
 
-    serialInitializationDirty = FALSE;
-    serialInitializationComplete = TRUE;
+    decoderInitialize(&scanner->decoder, protocol);
+    LOG(LOG_DEBUG, "  Decoding frames as %s (%s).", protocol->name, protocol->description);
+
+    scanner->initializationDirty = FALSE;
+    scanner->initializationComplete = TRUE;
 
     LOG(LOG_INFO, "Serial connection initialized!");
     return OK;
 }
 
-// Barcodes are sent as ASCII strings by the scanner.
-// Strings are delimited by 0x2 at the start and 0x3 at the end.
+// Barcodes are framed according to the protocol chosen at initialization.
+// Whole blocks are read from the device and decoded in a single pass: when a block holds more
+// than one barcode, the following ones are queued and returned without touching the device.
+// Never blocks: returns NULL when no complete frame is available yet (the rest of the frame comes with the
+// next serialWait) or when the device is lost, which sets scanner->lost.
 // WARNING: Resulting barcode must be free'd after use.
-char * readBarcode()
+char * readBarcode(SerialDevice *scanner, struct timespec *received)
 {
     LOG(LOG_INFO, "Preparing to read a barcode...");
 
-    char *barcode = malloc(sizeof(char));
-    char nextChar;
+    unsigned char block[SERIAL_BLOCK_SIZE];
 
-    int length = 0;
+    if(scanner->pendingCount == 0)
+        LOG(LOG_DEBUG, "  Reading from the device...");
 
-    // Check that no errors occurred while allocating.
-    if(barcode == NULL)
+    while(scanner->pendingCount == 0)
     {
-        serialTerminate();
-        free(barcode);
+        ssize_t length = read(scanner->fd, block, sizeof block);
 
-        LOG(LOG_ERROR, "  Failed to allocate memory for the barcode.");
+        if(length == FAILED)
+        {
+            if(errno == EINTR)
+                continue;
+
+            // Partial frame (or noise): the caller goes back to waiting, so that it can still be stopped.
+            if(errno == EAGAIN)
+            {
+                LOG(LOG_DEBUG, "  No complete frame yet.");
+                return NULL;
+            }
+
+            LOG(LOG_ERROR, "  Failed to read from the device.");
+            LOG(LOG_ERROR, "      The error was: %s", strerror(errno));
+            scanner->lost = TRUE;
+            return NULL;
+        }
+
+        if(length == 0)
+        {
+            LOG(LOG_ERROR, "  The device was closed.");
+            scanner->lost = TRUE;
+            return NULL;
+        }
 
-        return NULL;
+        decoderFeed(&scanner->decoder, block, length, queueBarcode, scanner);
     }
 
-    LOG(LOG_DEBUG, "  Waiting for a barcode...");
+    char *barcode = scanner->pending[scanner->pendingHead];
+
+    if(received != NULL)
+        *received = scanner->pendingTimes[scanner->pendingHead];
 
-    // Wait for the start of a new string to come.
-    do
+    scanner->pendingHead = (scanner->pendingHead + 1) % SERIAL_QUEUE_SIZE;
+    scanner->pendingCount--;
+
+    LOG(LOG_DEBUG, "Barcode read successfully: %s", barcode);
+    return barcode;
+}
+
+// Wait at most the given number of milliseconds (-1 for no limit) for a barcode to be available, or for the
+// interrupt descriptor (-1 for none) to become readable. Queued commands are written as the device accepts them.
+// Returns TRUE if readBarcode should be called (it never blocks, but may find only part of a frame), FALSE on
+// timeout, interruption or after writing commands. Callers waiting for the display to come back use a timeout,
+// so a partial frame never keeps them from reconnecting.
+int serialWait(SerialDevice *scanner, int timeout, int interruptFD)
+{
+    if(scanner->pendingCount > 0)
+        return TRUE;
+
+    short device = (scanner->outgoingCount > 0) ? POLLIN | POLLOUT : POLLIN;
+    struct pollfd events[2] = { { scanner->fd, device, 0 }, { interruptFD, POLLIN, 0 } };
+    int result = poll(events, 2, timeout);
+
+    if(result == FAILED)
+        return errno != EINTR;
+
+    if(events[0].revents & POLLOUT)
+        serialFlush(scanner, 0);
+
+    if(events[1].revents & POLLIN)
+        return FALSE;
+
+    // On errors let readBarcode find out what happened.
+    return (events[0].revents & ~POLLOUT) != 0;
+}
+
+// Parse a command given as hexadecimal bytes, optionally separated by spaces or colons ("1B 42 0D", "1b:42:0d", "1B420D").
+int serialParseCommand(SerialCommand *command, char *hex)
+{
+    command->length = 0;
+
+    for(char *c = hex; *c != 0; )
     {
-        nextChar = fgetc(deviceFS);
+        if(*c == ' ' || *c == ':')
+        {
+            c++;
+            continue;
+        }
+
+        if(!isxdigit(c[0]) || !isxdigit(c[1]) || command->length == SERIAL_COMMAND_SIZE)
+        {
+            command->length = 0;
+            return FAILED;
+        }
+
+        command->bytes[command->length++] = strtol((char[]) { c[0], c[1], 0 }, NULL, 16);
+        c += 2;
     }
-    while(nextChar != 0x02);
 
-    while(TRUE)
+    return OK;
+}
+
+// Queue a command for the scanner and write what the device accepts right away. When the frame the command
+// answers is given, the time from its end to the last byte of the command is accounted as feedback latency.
+int serialSend(SerialDevice *scanner, const SerialCommand *command, struct timespec *received)
+{
+    if(command->length == 0 || scanner->readOnly)
+        return OK;
+
+    if(scanner->outgoingCount == SERIAL_COMMAND_QUEUE)
     {
-        nextChar = fgetc(deviceFS);
+        LOG(LOG_WARNING, "  Too many commands waiting for the scanner: dropping one.");
+        scanner->commandsDropped++;
+        return FAILED;
+    }
 
-        if(nextChar == EOF)
-            continue;
+    QueuedCommand *queued = &scanner->outgoing[(scanner->outgoingHead + scanner->outgoingCount) % SERIAL_COMMAND_QUEUE];
+
+    queued->command = *command;
+    queued->written = 0;
+    queued->measured = (received != NULL);
+
+    if(received != NULL)
+        queued->received = *received;
+
+    scanner->outgoingCount++;
+    serialFlush(scanner, 0);
+
+    return OK;
+}
 
-        barcode = realloc(barcode, (length + 1) * sizeof(char));
+// Write the queued commands the device accepts without blocking. With a timeout (in milliseconds, -1 for no
+// limit) wait for the device every time it is full. Returns the number of commands still queued.
+int serialFlush(SerialDevice *scanner, int timeout)
+{
+    while(scanner->outgoingCount > 0)
+    {
+        QueuedCommand *queued = &scanner->outgoing[scanner->outgoingHead];
+        ssize_t written = write(scanner->fd, queued->command.bytes + queued->written, queued->command.length - queued->written);
 
-        // Check that no errors occurred while reallocating.
-        if(barcode == NULL)
+        if(written == FAILED)
         {
-            serialTerminate();
-            free(barcode);
+            if(errno == EINTR)
+                continue;
 
-            LOG(LOG_ERROR, "  Failed to expand memory for the barcode.");
+            if(errno != EAGAIN)
+            {
+                LOG(LOG_ERROR, "  Failed to write to the device.");
+                LOG(LOG_ERROR, "      The error was: %s", strerror(errno));
+                dropCommands(scanner);
+                break;
+            }
 
-            return NULL;
+            struct pollfd device = { scanner->fd, POLLOUT, 0 };
+
+            if(timeout == 0 || poll(&device, 1, timeout) <= 0)
+                break;
+
+            continue;
         }
 
-        if(nextChar != 0x03)
-            barcode[length++] = nextChar;
-        else
+        queued->written += written;
+
+        if(queued->written < queued->command.length)
+            continue;
+
+        if(queued->measured)
         {
-            barcode[length++] = 0;
-            break;
+            long latency = microsecondsSince(&queued->received);
+
+            if(scanner->feedbacks == 0 || latency < scanner->feedbackMinimum)
+                scanner->feedbackMinimum = latency;
+
+            if(latency > scanner->feedbackMaximum)
+                scanner->feedbackMaximum = latency;
+
+            scanner->feedbackTotal += latency;
+            scanner->feedbacks++;
         }
+
+        scanner->commandsSent++;
+        scanner->outgoingHead = (scanner->outgoingHead + 1) % SERIAL_COMMAND_QUEUE;
+        scanner->outgoingCount--;
     }
 
-    LOG(LOG_DEBUG, "Barcode read successfully: %s", barcode);
-    return barcode;
+    return scanner->outgoingCount;
+}
+
+// Forget the commands that could not be written.
+void dropCommands(SerialDevice *scanner)
+{
+    scanner->commandsDropped += scanner->outgoingCount;
+    scanner->outgoingHead = 0;
+    scanner->outgoingCount = 0;
+}
+
+// Called by the decoder for every complete frame.
+void queueBarcode(char *frame, int length, void *context)
+{
+    SerialDevice *scanner = context;
+
+    if(scanner->pendingCount == SERIAL_QUEUE_SIZE)
+    {
+        LOG(LOG_WARNING, "  Too many barcodes waiting to be typed: dropping \"%s\".", frame);
+        return;
+    }
+
+    char *barcode = malloc((length + 1) * sizeof(char));
+
+    // Check that no errors occurred while allocating.
+    if(barcode == NULL)
+    {
+        LOG(LOG_ERROR, "  Failed to allocate memory for the barcode.");
+        return;
+    }
+
+    memcpy(barcode, frame, length + 1);
+
+    int tail = (scanner->pendingHead + scanner->pendingCount) % SERIAL_QUEUE_SIZE;
+
+    scanner->pending[tail] = barcode;
+    clock_gettime(CLOCK_MONOTONIC, &scanner->pendingTimes[tail]);
+    scanner->pendingCount++;
 }
 
 // TODO: Are we sure close and fclose set errno?
-int serialTerminate()
+int serialTerminate(SerialDevice *scanner)
 {
     LOG(LOG_INFO, "Terminating serial connection...");
 
     int e = errno;
 
+    // Give the scanner a last chance to receive the feedback of the last scans.
+    if(scanner->initializedFS && serialFlush(scanner, SERIAL_FLUSH_TIMEOUT) > 0)
+    {
+        LOG(LOG_WARNING, "  %d commands were never sent to the scanner.", scanner->outgoingCount);
+        dropCommands(scanner);
+    }
+
     // Logical operators are short-circuited: the close operations only complete if the corresponding boolean is true.
     // Aparently, closing the filestream also closes the file descriptor.
-    if(initializedFS && fclose(deviceFS) == EOF)
+    if(scanner->initializedFS && fclose(scanner->stream) == EOF)
     {
-        serialInitializationDirty = TRUE;
+        scanner->initializationDirty = TRUE;
         LOG(LOG_ERROR, "  Failed to close device file stream and descriptor.");
         return errno;
     }
 
+    scanner->initializedFD = FALSE;
+    scanner->initializedFS = FALSE;
+
+    // Barcodes still waiting in the queue will never be read.
+    for(; scanner->pendingCount > 0; scanner->pendingCount--, scanner->pendingHead = (scanner->pendingHead + 1) % SERIAL_QUEUE_SIZE)
+        free(scanner->pending[scanner->pendingHead]);
+
      LOG(LOG_DEBUG, "  Closed serial device file stream and descriptor.");
      LOG(LOG_INFO, "Serial connection terminated!");
 
-    serialInitializationDirty = FALSE;
-    serialInitializationComplete = FALSE;
+    scanner->initializationDirty = FALSE;
+    scanner->initializationComplete = FALSE;
 
     return e;
 }
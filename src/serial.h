@@ -1,5 +1,69 @@
 #pragma once
 
-int serialInitialize(char *path, int setSerial);
-char *readBarcode();
-int serialTerminate();
\ No newline at end of file
+#include <stdio.h>
+#include <termios.h>
+#include <time.h>
+
+#include "protocol.h"
+
+// Number of decoded barcodes that can wait to be typed.
+#define SERIAL_QUEUE_SIZE 16
+
+// Longest command sent to the scanner, and number of commands that can wait to be written.
+#define SERIAL_COMMAND_SIZE 64
+#define SERIAL_COMMAND_QUEUE 16
+
+// Bytes sent to the scanner (beep, LED...), as given on the command line.
+typedef struct
+{
+    unsigned char bytes[SERIAL_COMMAND_SIZE];
+    int length;
+} SerialCommand;
+
+typedef struct
+{
+    SerialCommand command;
+    int written;                                    // Bytes already written to the device
+    int measured;                                   // Whether the time to write it counts as feedback latency...
+    struct timespec received;                       // ...from the end of this frame.
+} QueuedCommand;
+
+typedef struct
+{
+    int fd;                                         // File descriptor for scanner.
+    FILE *stream;                                   // File stream for scanner.
+    struct termios tty;                             // Serial device for scanner.
+
+    int initializedFD;
+    int initializedFS;
+    int lost;                                       // The device failed or was closed: readBarcode will never return again.
+    int readOnly;                                   // The device could only be opened for reading: no command is ever sent.
+
+    Decoder decoder;                                // Framing state machine for the scanner protocol.
+    char *pending[SERIAL_QUEUE_SIZE];               // Barcodes decoded but not yet returned by readBarcode...
+    struct timespec pendingTimes[SERIAL_QUEUE_SIZE];// ...and when their frame was completed.
+    int pendingHead;
+    int pendingCount;
+
+    QueuedCommand outgoing[SERIAL_COMMAND_QUEUE];   // Commands waiting for the device to accept them.
+    int outgoingHead;
+    int outgoingCount;
+
+    unsigned long commandsSent;                     // Commands completely written...
+    unsigned long commandsDropped;                  // ...and lost because the queue was full or the device failed.
+    unsigned long feedbacks;                        // Measured commands...
+    long feedbackTotal;                             // ...and microseconds from the end of their frame to their last byte.
+    long feedbackMinimum;
+    long feedbackMaximum;
+
+    int initializationDirty;
+    int initializationComplete;
+} SerialDevice;
+
+int serialInitialize(SerialDevice *scanner, char *path, int setSerial, const Protocol *protocol);
+char *readBarcode(SerialDevice *scanner, struct timespec *received);
+int serialWait(SerialDevice *scanner, int timeout, int interruptFD);
+int serialParseCommand(SerialCommand *command, char *hex);
+int serialSend(SerialDevice *scanner, const SerialCommand *command, struct timespec *received);
+int serialFlush(SerialDevice *scanner, int timeout);
+int serialTerminate(SerialDevice *scanner);
\ No newline at end of file
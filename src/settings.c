@@ -0,0 +1,456 @@
+#include <strings.h>
+
+#include "common.h"
+#include "settings.h"
+#include "terminators.h"
+
+// Replaced settings that may still be in use: every reader holds at most one of them.
+#define SETTINGS_MAX_RETIRED (SETTINGS_MAX_READERS + 1)
+
+Settings *currentSettings = NULL;                       // Published settings, only ever swapped atomically.
+Settings *hazards[SETTINGS_MAX_READERS];                // Settings every reader is using (NULL if none).
+Settings *retiredSettings[SETTINGS_MAX_RETIRED];        // Replaced settings waiting for their readers to be done.
+int retiredCount = 0;
+unsigned long settingsGeneration = 0;
+
+int loadFile(Settings *settings, char *path);
+int applySetting(Settings *settings, char *key, char *value);
+int parseTerminator(Settings *settings, char *string);
+char *trim(char *string);
+void reclaimSettings();
+
+/*
+ *  IMPORTANT NOTICE
+ *
+ *  Settings are read by the seat threads on every scan and replaced by the main thread on SIGHUP, without
+ *  locks on the typing path:
+ *
+ *  1) The main thread builds the new settings from scratch (parsing, regular expressions...), then swaps
+ *     the published pointer with a single atomic exchange. Published settings are never modified.
+ *  2) Readers announce the settings they use in their hazard slot before using them (settingsAcquire),
+ *     and clear it when done (settingsRelease). A reader keeps the same settings for a whole scan, so
+ *     a scan is never typed half with the old terminator and half with the new one.
+ *  3) Replaced settings are retired, and freed only once no hazard slot points to them. Every reader pins
+ *     at most one of them, so the retired list never holds more than SETTINGS_MAX_READERS + 1 entries.
+ *
+ *  Only the main thread publishes and reclaims settings.
+ */
+
+// Build the settings from the configuration file (if any), then from the command line, which wins.
+// Every invalid setting is reported and replaced by its default; errors counts them.
+Settings *settingsLoad(char *path, int argc, char **argv, int *errors)
+{
+    Settings *settings = calloc(1, sizeof *settings);
+
+    *errors = 0;
+
+    if(settings == NULL)
+    {
+        LOG(LOG_ERROR, "Failed to allocate memory for the settings.");
+        *errors = 1;
+        return NULL;
+    }
+
+    settings->generation = ++settingsGeneration;
+    settings->routing.generation = settings->generation;
+    settings->logLevel = LOG_DEFAULT;
+    settings->delay = 2;    // Two seconds should be just enough to switch windows with ALT+TAB.
+
+    if(path != NULL)
+        *errors += loadFile(settings, path);
+
+    const char *keys[] = { "terminator", "loglevel", "delay", "keydelay", "route", "ack", "nack",
+        "sessionstart", "sessionend", "sessionoutput", "sessionformat" };
+
+    for(int i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i)
+    {
+        char option[32];
+
+        snprintf(option, sizeof option, "--%s", keys[i]);
+
+        char *value = GETVALUE(option);
+
+        if(value != NULL && applySetting(settings, option + 2, value) == FAILED)
+            (*errors)++;
+    }
+
+    if(FINDSWITCH("--pacing"))
+        applySetting(settings, "pacing", "yes");
+
+    return settings;
+}
+
+// Read "<setting> = <value>" lines. Empty lines and lines starting with '#' are ignored.
+// Returns the number of invalid lines.
+int loadFile(Settings *settings, char *path)
+{
+    FILE *file = fopen(path, "r");
+
+    if(file == NULL)
+    {
+        LOG(LOG_ERROR, "Failed to open the configuration file %s.", path);
+        LOG(LOG_ERROR, "    The error was: %s", strerror(errno));
+        return 1;
+    }
+
+    char line[1024];
+    int number = 0;
+    int errors = 0;
+
+    while(fgets(line, sizeof line, file) != NULL)
+    {
+        char *key = trim(line);
+        char *value = strchr(key, '=');
+
+        number++;
+
+        if(key[0] == 0 || key[0] == '#')
+            continue;
+
+        if(value == NULL)
+        {
+            LOG(LOG_ERROR, "%s:%d: expected \"<setting> = <value>\".", path, number);
+            errors++;
+            continue;
+        }
+
+        *value++ = 0;
+
+        if(applySetting(settings, trim(key), trim(value)) == FAILED)
+        {
+            LOG(LOG_ERROR, "%s:%d: invalid setting.", path, number);
+            errors++;
+        }
+    }
+
+    fclose(file);
+    return errors;
+}
+
+// Set a single setting. On errors the setting keeps (or goes back to) its default.
+int applySetting(Settings *settings, char *key, char *value)
+{
+    if(SAMESTR(key, "terminator"))
+    {
+        if(parseTerminator(settings, value) == OK)
+            return OK;
+
+        LOG(LOG_ERROR, "\"%s\" is not a valid terminator: disabling terminator.", value);
+        settings->terminatorCount = 0;
+    }
+    else if(SAMESTR(key, "loglevel"))
+    {
+        int level = isNatural(value, LOG_DEBUG, LOG_FATAL);
+
+        if(level != FAILED)
+        {
+            settings->logLevel = level;
+            return OK;
+        }
+
+        LOG(LOG_ERROR, "\"%s\" is not a valid log level.", value);
+    }
+    else if(SAMESTR(key, "delay"))
+    {
+        int delay = isNatural(value, -1, -1);
+
+        if(delay != FAILED)
+        {
+            settings->delay = delay;
+            return OK;
+        }
+
+        LOG(LOG_ERROR, "\"%s\" is not a valid delay.", value);
+    }
+    else if(SAMESTR(key, "keydelay"))
+    {
+        int delay = isNatural(value, -1, -1);
+
+        if(delay != FAILED)
+        {
+            settings->keyDelay = delay;
+            return OK;
+        }
+
+        LOG(LOG_ERROR, "\"%s\" is not a valid key delay: typing without delay.", value);
+        settings->keyDelay = 0;
+    }
+    else if(SAMESTR(key, "pacing"))
+    {
+        if(strcasecmp(value, "yes") == 0 || strcasecmp(value, "no") == 0)
+        {
+            settings->adaptivePacing = (strcasecmp(value, "yes") == 0);
+            return OK;
+        }
+
+        LOG(LOG_ERROR, "\"%s\" is not a valid pacing (yes or no).", value);
+    }
+    else if(SAMESTR(key, "route"))
+    {
+        // Rules given later replace the previous ones.
+        routingTerminate(&settings->routing);
+
+        if(routingParse(&settings->routing, value) == OK)
+            return OK;
+
+        LOG(LOG_ERROR, "\"%s\" is not a valid list of routing rules: typing in the focused window.", value);
+    }
+    else if(SAMESTR(key, "ack") || SAMESTR(key, "nack"))
+    {
+        if(serialParseCommand(SAMESTR(key, "ack") ? &settings->ack : &settings->nack, value) == OK)
+            return OK;
+
+        LOG(LOG_ERROR, "\"%s\" is not a valid scanner command: not sending it.", value);
+    }
+    else if(SAMESTR(key, "sessionstart") || SAMESTR(key, "sessionend"))
+    {
+        char *barcode = SAMESTR(key, "sessionstart") ? settings->sessionStart : settings->sessionEnd;
+
+        if(strlen(value) < SETTINGS_MAX_STRING)
+        {
+            strcpy(barcode, value);
+            return OK;
+        }
+
+        LOG(LOG_ERROR, "\"%s\" is too long for a control barcode.", value);
+    }
+    else if(SAMESTR(key, "sessionoutput"))
+    {
+        int output = batchParseOutput(value, settings->sessionPath, SETTINGS_MAX_STRING);
+
+        if(output != FAILED)
+        {
+            settings->sessionOutput = output;
+            return OK;
+        }
+
+        LOG(LOG_ERROR, "\"%s\" is not a valid session output: typing the sessions.", value);
+        settings->sessionOutput = BATCH_TYPE;
+    }
+    else if(SAMESTR(key, "sessionformat"))
+    {
+        int format = batchParseFormat(value);
+
+        if(format != FAILED)
+        {
+            settings->sessionFormat = format;
+            return OK;
+        }
+
+        LOG(LOG_ERROR, "\"%s\" is not a valid session format (tsv, csv or ndjson).", value);
+    }
+    else
+        LOG(LOG_ERROR, "\"%s\" is not a valid setting.", key);
+
+    return FAILED;
+}
+
+// Parse a terminator macro: a list of keys separated by spaces or commas. Every key can be preceded by
+// modifiers ("CTRL+S", "CTRL+SHIFT+TAB") and followed by a number of repetitions ("TAB*2").
+// Keycodes are resolved by every X11 context, once per display and settings.
+int parseTerminator(Settings *settings, char *string)
+{
+    TerminatorKey *keys = settings->terminator;
+    int count = 0;
+    int result = OK;
+
+    char *macro = strdup(string);
+    char *position;
+
+    if(macro == NULL)
+        return FAILED;
+
+    for(char *token = strtok_r(macro, " ,", &position); token != NULL && result == OK; token = strtok_r(NULL, " ,", &position))
+    {
+        unsigned int modifiers = 0;
+        int repetitions = 1;
+        char *separator;
+
+        // Everything before the last '+' is a modifier.
+        while(result == OK && (separator = strchr(token, '+')) != NULL && separator[1] != 0)
+        {
+            *separator = 0;
+            result = FAILED;
+
+            for(int i = 0; i < modifierCount; ++i)
+                if(strcasecmp(token, modifierNames[i]) == 0)
+                {
+                    modifiers |= modifierMasks[i];
+                    result = OK;
+                    break;
+                }
+
+            if(result == FAILED)
+                LOG(LOG_ERROR, "  \"%s\" is not a valid modifier.", token);
+
+            token = separator + 1;
+        }
+
+        if((separator = strrchr(token, '*')) != NULL && separator != token)
+        {
+            *separator = 0;
+
+            if((repetitions = isNatural(separator + 1, 1, TERMINATOR_MAX_KEYS)) == FAILED)
+            {
+                LOG(LOG_ERROR, "  \"%s\" is not a valid number of repetitions.", separator + 1);
+                result = FAILED;
+            }
+        }
+
+        KeySym symbol = NoSymbol;
+
+        for(int i = 0; i < terminatorCount; ++i)
+            if(strcasecmp(token, terminatorNames[i]) == 0)
+            {
+                symbol = terminatorSymbols[i];
+                break;
+            }
+
+        if(symbol == NoSymbol)
+            symbol = XStringToKeysym(token);
+
+        if(symbol == NoSymbol)
+        {
+            LOG(LOG_ERROR, "  \"%s\" is not a valid key.", token);
+            result = FAILED;
+        }
+
+        // NONE is a valid key that types nothing.
+        if(result == FAILED || symbol == XK_VoidSymbol)
+            continue;
+
+        for(int i = 0; i < repetitions; ++i)
+        {
+            if(count == TERMINATOR_MAX_KEYS)
+            {
+                LOG(LOG_ERROR, "  Terminator is longer than %d keys.", TERMINATOR_MAX_KEYS);
+                result = FAILED;
+                break;
+            }
+
+            keys[count].symbol = symbol;
+            keys[count].modifiers = modifiers;
+            count++;
+        }
+    }
+
+    free(macro);
+
+    if(result == FAILED)
+        return FAILED;
+
+    settings->terminatorCount = count;
+    return OK;
+}
+
+// Strip the spaces around a string, in place.
+char *trim(char *string)
+{
+    while(*string == ' ' || *string == '\t')
+        string++;
+
+    int length = strlen(string);
+
+    while(length > 0 && strchr(" \t\r\n", string[length - 1]) != NULL)
+        string[--length] = 0;
+
+    return string;
+}
+
+// Make the settings the ones used from the next scan on. The settings they replace are freed as soon
+// as no reader uses them any more.
+void settingsPublish(Settings *settings)
+{
+    Settings *previous = __atomic_exchange_n(&currentSettings, settings, __ATOMIC_SEQ_CST);
+
+    setLogLevel(settings->logLevel);
+
+    if(previous != NULL)
+        retiredSettings[retiredCount++] = previous;
+
+    reclaimSettings();
+}
+
+// Get the current settings, which stay valid until the same reader calls settingsRelease.
+const Settings *settingsAcquire(int reader)
+{
+    Settings *settings;
+
+    // Announce the settings, then check they are still the published ones: if they are, they cannot
+    // have been reclaimed in between, as reclaimSettings would have seen the announcement.
+    do
+    {
+        settings = __atomic_load_n(&currentSettings, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&hazards[reader], settings, __ATOMIC_SEQ_CST);
+    }
+    while(settings != __atomic_load_n(&currentSettings, __ATOMIC_SEQ_CST));
+
+    return settings;
+}
+
+void settingsRelease(int reader)
+{
+    __atomic_store_n(&hazards[reader], NULL, __ATOMIC_RELEASE);
+}
+
+// Free the retired settings no reader is using.
+void reclaimSettings()
+{
+    for(int i = 0; i < retiredCount; )
+    {
+        int used = FALSE;
+
+        for(int j = 0; j < SETTINGS_MAX_READERS && !used; ++j)
+            used = (__atomic_load_n(&hazards[j], __ATOMIC_SEQ_CST) == retiredSettings[i]);
+
+        if(used)
+        {
+            i++;
+            continue;
+        }
+
+        settingsFree(retiredSettings[i]);
+        retiredSettings[i] = retiredSettings[--retiredCount];
+    }
+}
+
+// Free settings that have never been published, or have been reclaimed.
+void settingsFree(Settings *settings)
+{
+    routingTerminate(&settings->routing);
+    free(settings);
+}
+
+// Free every settings no reader is using (all of them once the seats have stopped).
+void settingsTerminate()
+{
+    Settings *previous = __atomic_exchange_n(&currentSettings, NULL, __ATOMIC_SEQ_CST);
+
+    if(previous != NULL)
+        retiredSettings[retiredCount++] = previous;
+
+    reclaimSettings();
+}
+
+void settingsHelp()
+{
+    printf("\nValid terminator IDs:\n");
+    for(int i = 1; i < terminatorCount; ++i)
+        printf("    %s\n", terminatorNames[i]);
+    printf("    Any other X keysym name (for example s or F5).\n");
+    printf("\nTerminators are lists of keys separated by spaces. Every key can be preceded by modifiers\n");
+    printf("and followed by a number of repetitions, for example \"TAB*2 ENTER\" or \"CTRL+S\".\n");
+    printf("Valid modifiers:\n");
+    for(int i = 0; i < modifierCount; ++i)
+        printf("    %s\n", modifierNames[i]);
+    printf("\nRouting rules are separated by ';' and made of conditions separated by ','. Conditions are\n");
+    printf("barcode=<regex> (scans the rule applies to), class=<regex> and title=<regex> (target window),\n");
+    printf("for example \"barcode=^SN,class=^Firefox$;class=libreoffice\".\n");
+    printf("\nThe configuration file holds \"<setting> = <value>\" lines, where settings are terminator,\n");
+    printf("loglevel, delay, keydelay, pacing (yes or no), route, ack, nack, sessionstart, sessionend,\n");
+    printf("sessionoutput and sessionformat. Options given on the command line win over the file. The file\n");
+    printf("is read again on SIGHUP.\n");
+    printf("\nIntake sessions collect the scans between the sessionstart and sessionend control barcodes (or\n");
+    printf("two SIGUSR1) and submit them at once, one line per distinct barcode with its count. Outputs are\n");
+    printf("type, file:<path> and socket:<path>; formats are tsv (default), csv and ndjson.\n");
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include "batch.h"
+#include "routing.h"
+#include "serial.h"
+
+// Longest terminator macro, counting repetitions.
+#define TERMINATOR_MAX_KEYS 32
+
+// Threads that can use the settings at the same time (one per seat).
+#define SETTINGS_MAX_READERS 8
+
+// Longest control barcode or session output path.
+#define SETTINGS_MAX_STRING 256
+
+typedef struct
+{
+    KeySym symbol;              // Key to press
+    unsigned int modifiers;     // Modifier mask held while pressing it (ControlMask, ShiftMask...)
+} TerminatorKey;
+
+// Everything that can change while the program runs. Published settings are never modified:
+// a reload builds new ones and swaps them in (see settings.c).
+typedef struct
+{
+    unsigned long generation;                       // Increased by every reload
+
+    TerminatorKey terminator[TERMINATOR_MAX_KEYS];  // Keys typed after every scan
+    int terminatorCount;
+
+    int logLevel;
+    int delay;                                      // Seconds to wait before typing (loopback mode)
+    long keyDelay;                                  // Microseconds between keystrokes (initial gap if adaptive)
+    int adaptivePacing;
+
+    RoutingTable routing;
+    SerialCommand ack;                              // Sent to the scanner once a scan has been typed...
+    SerialCommand nack;                             // ...or when it could not be.
+
+    char sessionStart[SETTINGS_MAX_STRING];         // Control barcode opening an intake session ("" if none)...
+    char sessionEnd[SETTINGS_MAX_STRING];           // ...and the one submitting it (can be the same).
+    int sessionOutput;                              // BATCH_TYPE, BATCH_FILE or BATCH_SOCKET
+    char sessionPath[SETTINGS_MAX_STRING];          // File or socket of the output
+    int sessionFormat;                              // BATCH_TSV, BATCH_CSV or BATCH_NDJSON
+} Settings;
+
+Settings *settingsLoad(char *path, int argc, char **argv, int *errors);
+void settingsPublish(Settings *settings);
+const Settings *settingsAcquire(int reader);
+void settingsRelease(int reader);
+void settingsFree(Settings *settings);
+void settingsTerminate();
+void settingsHelp();
@@ -16,20 +16,29 @@
  *      2) Add the corresponding symbol (defined in /usr/lib/include/X11/keysymdef.h) to the same position of the terminatorSymbols array
  *      3) Update the terminatorCount to the new value
  * 
+ *      Modifiers are added the same way to the modifierNames and modifierMasks arrays.
+ * 
  *      NOTES
  *      =====
  * 
  *      1) Terminator 0 MUST *ALWAYS* be NONE/XK_VoidSymbol
+ *      2) Names are matched ignoring case. Keys that are not in the list are looked up by their
+ *         X keysym name (for example "s" or "F5"), see XStringToKeysym.
  */
 
-const int terminatorCount = 4;
+const int terminatorCount = 9;
 
 const char * terminatorNames[] =
 {
     "NONE",
     "ENTER",
     "TABULATION",
-    "SPACE"
+    "SPACE",
+    "TAB",
+    "ESCAPE",
+    "BACKSPACE",
+    "UP",
+    "DOWN"
 };
 
 KeySym terminatorSymbols[] =
@@ -37,5 +46,30 @@ KeySym terminatorSymbols[] =
     XK_VoidSymbol,
     XK_Return,
     XK_Tab,
-    XK_space
+    XK_space,
+    XK_Tab,
+    XK_Escape,
+    XK_BackSpace,
+    XK_Up,
+    XK_Down
+};
+
+const int modifierCount = 5;
+
+const char * modifierNames[] =
+{
+    "CTRL",
+    "CONTROL",
+    "SHIFT",
+    "ALT",
+    "SUPER"
+};
+
+unsigned int modifierMasks[] =
+{
+    ControlMask,
+    ControlMask,
+    ShiftMask,
+    Mod1Mask,
+    Mod4Mask
 };
\ No newline at end of file
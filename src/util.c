@@ -1,5 +1,6 @@
 #include "common.h"
 #include "util.h"
+#include "profile.h"
 
 // Console formatting codes for foreground color
 #define RED         "\x1B[31m"
@@ -17,11 +18,7 @@
 // Reset formatting
 #define RESET       "\x1B[0m"
 
-#if defined(DEBUG)
-    int logLevel = LOG_DEBUG;
-#else
-    int logLevel = LOG_ERROR;
-#endif
+int logLevel = LOG_DEFAULT;
 
 int quiet = FALSE;
 
@@ -42,9 +39,10 @@ char * autoFormat(char *, int, ...);
  *  TODO: Actually implement extensive tests.
  */
 
+// Can be called while other threads are logging (on reload).
 void setLogLevel(const int level)
 {
-    logLevel = level;
+    __atomic_store_n(&logLevel, level, __ATOMIC_RELAXED);
     return;
 }
 
@@ -56,9 +54,11 @@ void beQuiet()
 
 int logEvent(const char *fileName, const int lineNumber, const char* function, int severity, char *format, int count, ...)
 {
-    if(severity < logLevel || quiet)
+    if(severity < __atomic_load_n(&logLevel, __ATOMIC_RELAXED) || quiet)
         return OK;
 
+    profileEnter(PROFILE_LOG);
+
     char *color = NULL;
     char *type = NULL;
 
@@ -92,11 +92,14 @@ int logEvent(const char *fileName, const int lineNumber, const char* function, i
     if((prologue = autoFormat(prologueFormat, countFormatIdentifiers(prologueFormat), type, fileName, lineNumber, function)) == NULL)
     {
         LOG(LOG_ERROR, "Failed to construct log prologue message.");
+        profileLeave(PROFILE_LOG);
         return FAILED;
     }
 
     // Print the intestation and message.
     // Passing VAs by reference so we can use NULL as a signal.
+    // Every seat logs from its own thread: hold the stream so that lines are not interleaved.
+    flockfile(stdout);
     prettyPrint(TRUE, FALSE, color, prologue, NULL, stdout);
     
     va_list args;
@@ -105,7 +108,9 @@ int logEvent(const char *fileName, const int lineNumber, const char* function, i
     prettyPrint(FALSE, TRUE, color, format, &args, stdout);
 
     va_end(args);
+    funlockfile(stdout);
     free(prologue);
+    profileLeave(PROFILE_LOG);
     return OK;
 }
 
@@ -220,6 +225,21 @@ char *getValue(int argc, char **argv, char *name)
     return NULL;        
 }
 
+// Get the value of the n-th occurrence (starting from 0) of a repeatable parameter
+char *getNthValue(int argc, char **argv, char *name, int n)
+{
+    for(int i = 0; i < argc; ++i)
+        if((strlen(name) == strlen(argv[i])) && !strcmp(name, argv[i]) && n-- == 0)
+        {
+            if((i + 1) < argc && argv[i+1][0] != '-')
+                return argv[i+1];
+            else
+                return NULL;
+        }
+    
+    return NULL;        
+}
+
 // Wether the input is a natural number and, optionally, within a closed interval
 // On success, return the number
 // On failure, return -1
@@ -243,4 +263,63 @@ int isNatural(char *number, int min, int max)
         return FAILED;
     
     return num;
+}
+
+// Decode the UTF-8 character at the start of the string and advance the string past it.
+// On success, return the Unicode codepoint
+// On failure (invalid or overlong sequence), skip one byte and return -1
+int decodeUTF8(const char **string)
+{
+    const unsigned char *bytes = (const unsigned char *) *string;
+    int length;
+    int codepoint;
+
+    if(bytes[0] < 0x80)
+    {
+        (*string)++;
+        return bytes[0];
+    }
+    else if((bytes[0] & 0xE0) == 0xC0)
+    {
+        length = 2;
+        codepoint = bytes[0] & 0x1F;
+    }
+    else if((bytes[0] & 0xF0) == 0xE0)
+    {
+        length = 3;
+        codepoint = bytes[0] & 0x0F;
+    }
+    else if((bytes[0] & 0xF8) == 0xF0)
+    {
+        length = 4;
+        codepoint = bytes[0] & 0x07;
+    }
+    else
+    {
+        (*string)++;
+        return FAILED;
+    }
+
+    for(int i = 1; i < length; ++i)
+    {
+        // Also catches the end of the string, since 0 is not a continuation byte.
+        if((bytes[i] & 0xC0) != 0x80)
+        {
+            (*string)++;
+            return FAILED;
+        }
+
+        codepoint = (codepoint << 6) | (bytes[i] & 0x3F);
+    }
+
+    // Reject overlong encodings, surrogates and values beyond the Unicode range.
+    if((length == 2 && codepoint < 0x80) || (length == 3 && codepoint < 0x800) || (length == 4 && codepoint < 0x10000) ||
+       (codepoint >= 0xD800 && codepoint <= 0xDFFF) || codepoint > 0x10FFFF)
+    {
+        (*string)++;
+        return FAILED;
+    }
+
+    *string += length;
+    return codepoint;
 }
\ No newline at end of file
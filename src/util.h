@@ -9,8 +9,15 @@
 #define LOG_ERROR   3
 #define LOG_FATAL   4
 
+#if defined(DEBUG)
+    #define LOG_DEFAULT LOG_DEBUG
+#else
+    #define LOG_DEFAULT LOG_ERROR
+#endif
+
 #define FINDSWITCH(string) findSwitch(argc, argv, string)
 #define GETVALUE(string) getValue(argc, argv, string)
+#define GETNTHVALUE(string, n) getNthValue(argc, argv, string, n)
 
 void setLogLevel(const int level);
 void beQuiet();
@@ -19,4 +26,6 @@ void prettyPrint(int, int, char *, char *, va_list *, FILE *);
 int countFormatIdentifiers(char *);
 int findSwitch(int argc, char **argv, char *name);
 char *getValue(int argc, char **argv, char *name);
-int isNatural(char *number, int min, int max);
\ No newline at end of file
+char *getNthValue(int argc, char **argv, char *name, int n);
+int isNatural(char *number, int min, int max);
+int decodeUTF8(const char **string);
\ No newline at end of file
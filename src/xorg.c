@@ -1,67 +1,285 @@
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <poll.h>
+#include <time.h>
 
 #include "common.h"
+#include "xorg.h"
 
-extern const char * terminatorNames[];
-extern KeySym terminatorSymbols[];
-
-Display *X11Display;
-Window rootWindow;
 
 int errorHandler(Display *, XErrorEvent *);
-int sendKeyEvent(int press, char letter, Window window);
-int sendTerminator(int terminatorIndex, Window window);
-int X11Terminate();
-
-int X11InitializationComplete = FALSE;
-int X11InitializationDirty = FALSE;
-
-// Get the display for the system.
+int ioErrorHandler(Display *);
+void ioErrorExitHandler(Display *, void *);
+int X11Connect(X11Context *context);
+void X11Disconnect(X11Context *context);
+void processEvents(X11Context *context);
+void handleEvent(X11Context *context, XEvent *event);
+int typeNow(X11Context *context, char *string);
+int queueScan(X11Context *context, char *string);
+int sendKeyEvent(X11Context *context, int press, KeyCode keycode, unsigned int state, Window window);
+int reserveTyped(X11Context *context, int length);
+int sendTerminator(X11Context *context, Window window);
+void encodeTerminator(X11Context *context);
+const char *getWindowClass(X11Context *context, Window window);
+long probeDelivery(X11Context *context);
+void preparePing(X11Context *context, Window window);
+long pingApplication(X11Context *context);
+
+__thread X11Context *threadContext = NULL;  // Context last polled by the calling thread, told about errors by errorHandler.
+
+// Prepare the context for a display (NULL for $DISPLAY). The display is opened now if available, later otherwise.
 // TODO: Validate this code against multi-monitor setups.
-int X11Initialize()
+int X11Initialize(X11Context *context, char *displayName)
 {
     LOG(LOG_INFO, "Initializing X11 interface...");
 
     // If the initialization has already been completed, do nothing
-    if(X11InitializationComplete)
+    if(context->initializationComplete)
     {
         LOG(LOG_DEBUG, "  Skipping initialization: already complete.");
         LOG(LOG_DEBUG, "  If you want to reinitialize X11, terminate it first.");
         return OK;
     }
 
-    if(X11InitializationDirty)
+    if(context->initializationDirty)
         LOG(LOG_WARNING, "  Previous X11 initialization attempt did not complete successfully.");
 
     // We clear this value when we complete initialization. This way we know if a previous attempt failed.
-    X11InitializationDirty = TRUE;
+    context->initializationDirty = TRUE;
+    context->displayName = displayName;
+
+    // We are not interested in the previous handlers so we ignore return values.
+    XSetErrorHandler(errorHandler);
+    XSetIOErrorHandler(ioErrorHandler);
+    LOG(LOG_DEBUG, "  Hooked to X11 error handlers.");
 
-    X11Display = XOpenDisplay(NULL);
+    // The display may not be there yet (for example before login): scans are queued until it is.
+    if(X11Connect(context) == FAILED)
+        LOG(LOG_WARNING, "  Display not available yet: will keep trying to connect.");
 
-    if(X11Display == NULL)
+    LOG(LOG_INFO, "X11 interface initialized!");
+
+    context->initializationDirty = FALSE;
+    context->initializationComplete = TRUE;
+    return OK;
+}
+
+// Open the display and prepare everything that depends on it.
+int X11Connect(X11Context *context)
+{
+    clock_gettime(CLOCK_MONOTONIC, &context->lastConnectionAttempt);
+
+    context->display = XOpenDisplay(context->displayName);
+
+    if(context->display == NULL)
     {
-        LOG(LOG_ERROR, "  Failed to open display!");
-        X11InitializationDirty = TRUE;
-        return X11Terminate();
+        LOG(LOG_DEBUG, "  Failed to open display %s.", XDisplayName(context->displayName));
+        return FAILED;
     }
 
     LOG(LOG_DEBUG, "  Display opened successfully.");
 
-    rootWindow = DefaultRootWindow(X11Display);
+    // Let Xlib return to us instead of exiting when the connection breaks.
+    XSetIOErrorExitHandler(context->display, ioErrorExitHandler, context);
+    context->lost = FALSE;
+
+    context->rootWindow = DefaultRootWindow(context->display);
     LOG(LOG_DEBUG, "  Hooked to default root window for the display.");
 
-    // We are not interested in the previous handler so we ignore return value.
-    XSetErrorHandler(errorHandler);
-    LOG(LOG_DEBUG, "  Hooked to X11 error handler.");
-    
-    LOG(LOG_INFO, "X11 interface initialized!");
+    if(keymapInitialize(&context->keymap, context->display) == FAILED)
+    {
+        LOG(LOG_ERROR, "  Failed to initialize keyboard mapping!");
+        X11Disconnect(context);
+        return FAILED;
+    }
+
+    // The terminator is encoded and the windows are indexed when typing the first scan.
+    context->terminatorGeneration = 0;
+    context->classWindow = None;
+    context->pingFocus = None;
+    context->rootSelected = FALSE;
+
+    context->wmProtocols = XInternAtom(context->display, "WM_PROTOCOLS", False);
+    context->netWmPing = XInternAtom(context->display, "_NET_WM_PING", False);
+
+    LOG(LOG_INFO, "Connected to display %s.", DisplayString(context->display));
+    return OK;
+}
+
+// Close the display. If the connection broke, nothing is sent to the server.
+void X11Disconnect(X11Context *context)
+{
+    if(context->display == NULL)
+        return;
+
+    keymapTerminate(&context->keymap, context->lost ? NULL : context->display);
+    windowIndexClear(&context->windowIndex);
+    XCloseDisplay(context->display);
+
+    context->display = NULL;
+    context->lost = FALSE;
+}
+
+int X11Connected(X11Context *context)
+{
+    return context->display != NULL && !context->lost;
+}
+
+// Keep the connection alive: close it if it broke, try to reopen it at most every X11_RETRY_INTERVAL
+// milliseconds, and type the scans queued while it was down as soon as it is back.
+// The events received since the last call are handled here, so that they never pile up in Xlib.
+void X11Poll(X11Context *context)
+{
+    // Everything typed with this context goes through here first, from the thread using it.
+    threadContext = context;
+
+    if(context->lost)
+    {
+        LOG(LOG_WARNING, "Connection to display %s lost: reconnecting...", XDisplayName(context->displayName));
+        X11Disconnect(context);
+    }
+
+    if(context->display == NULL && microsecondsSince(&context->lastConnectionAttempt) >= X11_RETRY_INTERVAL * 1000L)
+        X11Connect(context);
+
+    // Routing may have been disabled by a reload: the windows it followed are let go, the root window included.
+    if(X11Connected(context) && context->settings != NULL && !routingEnabled(&context->settings->routing) && context->windowIndex.built)
+    {
+        windowIndexRelease(context->display, &context->windowIndex);
+        context->rootSelected = FALSE;
+    }
+
+    // Same for the answers to the pings of adaptive pacing.
+    if(X11Connected(context) && context->settings != NULL && !context->settings->adaptivePacing && context->rootSelected)
+    {
+        XSelectInput(context->display, context->rootWindow, NoEventMask);
+        context->rootSelected = FALSE;
+    }
+
+    if(X11Connected(context))
+        processEvents(context);
+
+    while(X11Connected(context) && context->queuedCount > 0)
+    {
+        char *string = context->queuedScans[context->queuedHead];
+
+        LOG(LOG_INFO, "Typing scan \"%s\" received while the display was not available.", string);
+
+        if(typeNow(context, string) == FAILED && !context->lost)
+            LOG(LOG_ERROR, "  Failed to type the scan: dropping it.");
+        else if(context->lost)
+            return;
+
+        context->queuedHead = (context->queuedHead + 1) % X11_QUEUE_SIZE;
+        context->queuedCount--;
+        free(string);
+    }
+}
+
+// Handle the events received so far without waiting for new ones.
+void processEvents(X11Context *context)
+{
+    while(XPending(context->display))
+    {
+        XEvent event;
+
+        XNextEvent(context->display, &event);
+        handleEvent(context, &event);
+    }
+}
+
+void handleEvent(X11Context *context, XEvent *event)
+{
+    // The keyboard mapping changed (our own spare bindings included): Xlib, the spares and the terminator follow.
+    if(event->type == MappingNotify)
+    {
+        XRefreshKeyboardMapping(&event->xmapping);
+
+        if(event->xmapping.request == MappingKeyboard && keymapRefresh(&context->keymap, context->display) == FAILED)
+            LOG(LOG_ERROR, "  Failed to read the new keyboard mapping.");
+
+        context->terminatorGeneration = 0;
+        return;
+    }
+
+    // The index ignores what it does not follow, late answers to pings that timed out included.
+    windowIndexHandle(context->display, &context->windowIndex, event);
+}
+
+// Keep a copy of a scan to type once the display is available again.
+// When the queue is full the oldest scan is dropped.
+int queueScan(X11Context *context, char *string)
+{
+    char *copy = strdup(string);
+
+    if(copy == NULL)
+    {
+        LOG(LOG_ERROR, "  Failed to allocate memory to queue the scan.");
+        return FAILED;
+    }
+
+    if(context->queuedCount == X11_QUEUE_SIZE)
+    {
+        LOG(LOG_WARNING, "  Too many scans waiting for the display: dropping \"%s\".", context->queuedScans[context->queuedHead]);
 
-    X11InitializationDirty = FALSE;
+        free(context->queuedScans[context->queuedHead]);
+        context->queuedHead = (context->queuedHead + 1) % X11_QUEUE_SIZE;
+        context->queuedCount--;
+    }
+
+    context->queuedScans[(context->queuedHead + context->queuedCount) % X11_QUEUE_SIZE] = copy;
+    context->queuedCount++;
+
+    LOG(LOG_WARNING, "Display not available: queued scan \"%s\" (%d waiting).", string, context->queuedCount);
     return OK;
 }
 
+// Build the KeyPress/KeyRelease events of the terminator once per display and settings, so that sending it
+// after a scan requires no lookup at all: only the target window changes between scans.
+void encodeTerminator(X11Context *context)
+{
+    const Settings *settings = context->settings;
+
+    context->terminatorEventCount = 0;
+    context->terminatorGeneration = settings->generation;
+
+    for(int i = 0; i < settings->terminatorCount; ++i)
+    {
+        KeyCode keycode = XKeysymToKeycode(context->display, settings->terminator[i].symbol);
+
+        if(keycode == 0)
+        {
+            LOG(LOG_WARNING, "  Terminator key %s is not mapped on this keyboard: skipping it.", XKeysymToString(settings->terminator[i].symbol));
+            continue;
+        }
+
+        XKeyEvent event;
+
+        event.display = context->display;
+        event.window = None;
+        event.root = context->rootWindow;
+        event.subwindow = None;
+        event.time = CurrentTime;
+        event.x = 1;
+        event.y = 1;
+        event.x_root = 1;
+        event.y_root = 1;
+        event.same_screen = TRUE;
+        event.keycode = keycode;
+        event.state = settings->terminator[i].modifiers;
+
+        event.type = KeyPress;
+        context->terminatorEvents[context->terminatorEventCount++] = event;
+
+        event.type = KeyRelease;
+        context->terminatorEvents[context->terminatorEventCount++] = event;
+    }
+
+    LOG(LOG_DEBUG, "  Encoded terminator as %d key events.", context->terminatorEventCount);
+}
+
 // Type the string in the currently focused window.
-int typeString(char *string, int delaySeconds, int terminatorIndex)
+int typeString(X11Context *context, char *string, int delaySeconds)
 {
     // Wait for delay
     if(delaySeconds)
@@ -74,89 +292,383 @@ int typeString(char *string, int delaySeconds, int terminatorIndex)
         return FAILED;
     }
 
-    LOG(LOG_DEBUG, "Typing the string \"%s\" of length %d into the currently focused window.", string, strlen(string));
+    // Reconnect and type the queued scans first, so the order of the scans is preserved.
+    X11Poll(context);
+
+    if(!X11Connected(context) || context->queuedCount > 0)
+        return queueScan(context, string);
+
+    if(typeNow(context, string) == FAILED && !context->lost)
+        return FAILED;
+
+    // Writing to a dead server fails when the events are flushed: nothing has been typed.
+    if(context->lost)
+    {
+        queueScan(context, string);
+        X11Poll(context);
+    }
+
+    return OK;
+}
+
+// Type a block of lines in one go, as a spreadsheet paste: tabs and newlines are typed as Tab and Return
+// and the terminator only follows the last line. Unlike scans, blocks are not queued while the display
+// is not available: the caller keeps them.
+int typeBlock(X11Context *context, char *block)
+{
+    X11Poll(context);
+
+    if(!X11Connected(context) || context->queuedCount > 0)
+    {
+        LOG(LOG_WARNING, "Display %s not available: not typing the block.", XDisplayName(context->displayName));
+        return FAILED;
+    }
+
+    context->typingBlock = TRUE;
+
+    int result = typeNow(context, block);
 
-    Window currentWindow;
+    context->typingBlock = FALSE;
+
+    // Some lines may have been typed before the connection broke.
+    if(context->lost)
+    {
+        LOG(LOG_ERROR, "  Lost display %s while typing the block.", XDisplayName(context->displayName));
+        X11Poll(context);
+        return FAILED;
+    }
+
+    return result;
+}
+
+// Type the string in the currently focused window of the open display.
+int typeNow(X11Context *context, char *string)
+{
+    LOG(LOG_DEBUG, "Typing the string \"%s\" of length %d.", string, strlen(string));
+
+    const Settings *settings = context->settings;
+    Window currentWindow = None;
     int revert;
 
-    // Get the window that has the input focus.
-    XGetInputFocus(X11Display, &currentWindow, &revert);
+    // Settings reloaded since the last scan take effect now.
+    if(context->terminatorGeneration != settings->generation)
+        encodeTerminator(context);
+
+    pacingConfigure(&context->pacing, settings->adaptivePacing, settings->keyDelay);
+
+    // The routing index and the keyboard mapping must reflect what happened since the last scan.
+    processEvents(context);
+
+    // Get the window chosen by the routing rules or, if none, the window that has the input focus.
+    if(routingEnabled(&settings->routing))
+        currentWindow = routingResolve(&settings->routing, context->display, &context->windowIndex, context->typingBlock ? NULL : string);
+
+    if(currentWindow == None)
+        XGetInputFocus(context->display, &currentWindow, &revert);
+
+    // Decode the string into keysyms: there can't be more characters than bytes.
+    if(reserveTyped(context, strlen(string)) == FAILED)
+        return FAILED;
+
+    int count = 0;
 
-    for(int i = 0; i < strlen(string); i++)
+    for(const char *next = string; *next != 0;)
     {
-        // ASCII characters from 0x20 to 0xFF directly map to the corresponding KeySym.
-        // ASCII characters below 0x20 are just control characters and should never appear (can be ignored).
-        if(string[i] == '\n')
+        int codepoint = decodeUTF8(&next);
+
+        // Unicode characters directly map to a KeySym (see codepointToKeysym).
+        // Control characters should never appear (can be ignored).
+        if(context->typingBlock && (codepoint == '\t' || codepoint == '\n'))
+        {
+            context->typedSymbols[count++] = (codepoint == '\t') ? XK_Tab : XK_Return;
+            continue;
+        }
+        else if(codepoint == '\n')
         {
             // "Silently" ignore newline (probably coming from interactive mode).
             LOG(LOG_DEBUG, "  Ignoring newline in barcode string (probably coming from interactive mode).");
             continue;
         }
-        else if(string[i] < 0x20 || string[i] > 0x7E)
+        else if(codepoint == FAILED)
+        {
+            LOG(LOG_WARNING, "  Ignoring invalid UTF-8 sequence in input string.");
+            continue;
+        }
+        else if(codepoint < 0x20 || (codepoint >= 0x7F && codepoint < 0xA0))
+        {
+            LOG(LOG_WARNING, "  Ignoring control character U+%04X in input string.", codepoint);
+            continue;
+        }
+
+        context->typedSymbols[count++] = codepointToKeysym(codepoint);
+    }
+
+    // Find all the keycodes at once: characters missing from the keyboard are bound with a single mapping change.
+    if(keymapResolve(&context->keymap, context->display, context->typedSymbols, count, context->typedKeycodes, context->typedStates) == FAILED)
+        return FAILED;
+
+    int adaptive = pacingIsAdaptive(&context->pacing);
+    long gap = pacingBegin(&context->pacing, adaptive ? getWindowClass(context, currentWindow) : NULL);
+    int sent = 0;
+
+    if(adaptive)
+        preparePing(context, currentWindow);
+
+    // Only the errors caused by the keystrokes tell whether the scan was typed.
+    unsigned long errors = context->errors;
+
+    for(int i = 0; i < count; i++)
+    {
+        if(context->typedKeycodes[i] == 0)
         {
-            LOG(LOG_WARNING, "  Ignoring invalid ASCII character in input string.");
+            LOG(LOG_WARNING, "  Ignoring character that can't be typed (keysym 0x%08lX).", context->typedSymbols[i]);
             continue;
         }
 
-        LOG(LOG_DEBUG, "  Sending keycode 0x%02X corresponding to letter \'%c\'...", XKeysymToKeycode(X11Display, (KeySym) string[i]), string[i]);
+        LOG(LOG_DEBUG, "  Sending keycode 0x%02X with state 0x%X corresponding to keysym 0x%08lX...", context->typedKeycodes[i], context->typedStates[i], context->typedSymbols[i]);
 
-        if(sendKeyEvent(TRUE, string[i], currentWindow) == FAILED)
+        if(sendKeyEvent(context, TRUE, context->typedKeycodes[i], context->typedStates[i], currentWindow) == FAILED)
             return FAILED;
 
         LOG(LOG_DEBUG, "    Sent KeyPress event");
 
-        if(sendKeyEvent(FALSE, string[i], currentWindow) == FAILED)
+        if(sendKeyEvent(context, FALSE, context->typedKeycodes[i], context->typedStates[i], currentWindow) == FAILED)
             return FAILED;
 
         LOG(LOG_DEBUG, "   Sent KeyRelease event");
 
-        XFlush(X11Display);
+        XFlush(context->display);
+        pacingWait(gap);
+
+        if(adaptive && ++sent % PACING_PROBE_INTERVAL == 0)
+            gap = probeDelivery(context);
     }
 
     LOG(LOG_DEBUG, "  Sending terminator...");
 
-    if(sendTerminator(terminatorIndex, currentWindow) == FAILED)
+    if(sendTerminator(context, currentWindow) == FAILED)
         return FAILED;
 
     LOG(LOG_DEBUG, "  Sent terminator");
 
-    XFlush(X11Display);
-        
+    XFlush(context->display);
+
+    if(adaptive)
+    {
+        probeDelivery(context);
+        pacingEnd(&context->pacing);
+    }
+
+    // The events have only been flushed: wait for the server to handle them, so that a scan it rejected
+    // (the routed window was closed in the meantime...) never gets the good-read feedback.
+    XSync(context->display, False);
+
+    if(context->errors != errors)
+    {
+        LOG(LOG_ERROR, "  The X server rejected %lu requests while typing.", context->errors - errors);
+        return FAILED;
+    }
+
     return OK;
 }
 
-// Send a XKeyEvent to the specified window with the keycode of the corresponding ASCII letter.
-int sendKeyEvent(int press, char letter, Window window)
+// Wait for the application (or, if it cannot tell, the server) to process everything sent so far and feed the
+// round-trip time to the pacing controller. Returns the gap to use for the following keystrokes.
+long probeDelivery(X11Context *context)
 {
-    XKeyEvent event;
+    struct timespec start;
 
-    event.display = X11Display;
-    event.window = window;
-    event.root = rootWindow;
-    event.subwindow = None;
-    event.time = CurrentTime;
-    event.x = 1;
-    event.y = 1;
-    event.x_root = 1;
-    event.y_root = 1;
-    event.same_screen = TRUE;
-    event.keycode = XKeysymToKeycode(X11Display, (KeySym) letter);
-    event.state = 0;
-    event.type = press ? KeyPress : KeyRelease;
+    if(context->pingWindow != None && !context->pingTimedOut)
+    {
+        long roundTrip = pingApplication(context);
+
+        if(roundTrip != FAILED)
+            return pacingFeedback(&context->pacing, roundTrip, TRUE);
 
-    if(XSendEvent(X11Display, window, TRUE, KeyPressMask, (XEvent *) &event) == 0)
+        LOG(LOG_WARNING, "  Window 0x%08lX did not answer _NET_WM_PING within %dms: slowing down.", context->pingWindow, PACING_PING_TIMEOUT);
+        context->pingTimedOut = TRUE;
+
+        return pacingFeedback(&context->pacing, PACING_PING_TIMEOUT * 1000L, TRUE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    XSync(context->display, False);
+
+    return pacingFeedback(&context->pacing, microsecondsSince(&start), FALSE);
+}
+
+// Find the client window of the focused one, looking at its ancestors, and whether it answers _NET_WM_PING.
+// The result is cached until the focus moves to another window.
+void preparePing(X11Context *context, Window window)
+{
+    context->pingTimedOut = FALSE;
+
+    if(window == context->pingFocus)
+        return;
+
+    context->pingFocus = window;
+    context->pingWindow = None;
+
+    while(window != None && window != context->rootWindow && window != PointerRoot)
+    {
+        Atom *protocols;
+        int protocolCount;
+
+        // The first window with WM_PROTOCOLS is the client window, whether it lists the ping or not.
+        if(XGetWMProtocols(context->display, window, &protocols, &protocolCount))
+        {
+            for(int i = 0; i < protocolCount; ++i)
+                if(protocols[i] == context->netWmPing)
+                    context->pingWindow = window;
+
+            XFree(protocols);
+            break;
+        }
+
+        Window root, parent, *children;
+        unsigned int count;
+
+        if(!XQueryTree(context->display, window, &root, &parent, &children, &count))
+            break;
+
+        if(children != NULL)
+            XFree(children);
+
+        window = parent;
+    }
+
+    LOG(LOG_DEBUG, "  Probing delivery with %s.", context->pingWindow != None ? "_NET_WM_PING" : "XSync (the application does not answer pings)");
+
+    // The routing index already listens to the root window.
+    if(context->pingWindow != None && !context->windowIndex.built && !context->rootSelected)
+    {
+        XSelectInput(context->display, context->rootWindow, SubstructureNotifyMask);
+        context->rootSelected = TRUE;
+    }
+}
+
+// Send _NET_WM_PING to the application and wait for its answer, which it only sends once it has read every
+// event sent to it before. Returns the round-trip time in microseconds, FAILED if there was no answer in time.
+long pingApplication(X11Context *context)
+{
+    XEvent ping;
+    struct timespec start;
+
+    memset(&ping, 0, sizeof ping);
+    ping.xclient.type = ClientMessage;
+    ping.xclient.window = context->pingWindow;
+    ping.xclient.message_type = context->wmProtocols;
+    ping.xclient.format = 32;
+    ping.xclient.data.l[0] = context->netWmPing;
+    ping.xclient.data.l[1] = ++context->pingSerial;      // In place of a timestamp: applications send it back as is.
+    ping.xclient.data.l[2] = context->pingWindow;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(XSendEvent(context->display, context->pingWindow, False, NoEventMask, &ping) == 0)
         return FAILED;
-    else
+
+    XFlush(context->display);
+
+    // The answer comes back to the root window; other events received meanwhile are handled as usual.
+    while(!context->lost)
+    {
+        long remaining = PACING_PING_TIMEOUT - microsecondsSince(&start) / 1000;
+        XEvent event;
+
+        if(remaining <= 0)
+            return FAILED;
+
+        if(XPending(context->display) == 0)
+        {
+            struct pollfd connection = { ConnectionNumber(context->display), POLLIN, 0 };
+
+            poll(&connection, 1, remaining);
+            continue;
+        }
+
+        XNextEvent(context->display, &event);
+
+        if(event.type == ClientMessage && event.xclient.message_type == context->wmProtocols
+            && (Atom) event.xclient.data.l[0] == context->netWmPing && event.xclient.data.l[1] == context->pingSerial)
+            return microsecondsSince(&start);
+
+        handleEvent(context, &event);
+    }
+
+    return FAILED;
+}
+
+// Find the WM_CLASS of a window, looking at its ancestors if the focus is on a child without one.
+// The result is cached until the focus moves to another window.
+const char *getWindowClass(X11Context *context, Window window)
+{
+    if(window == context->classWindow)
+        return context->windowClass;
+
+    context->classWindow = window;
+    context->windowClass[0] = 0;
+
+    while(window != None && window != context->rootWindow && window != PointerRoot)
+    {
+        XClassHint hint;
+
+        if(XGetClassHint(context->display, window, &hint))
+        {
+            snprintf(context->windowClass, sizeof context->windowClass, "%s", hint.res_class ? hint.res_class : "");
+            XFree(hint.res_name);
+            XFree(hint.res_class);
+            break;
+        }
+
+        Window root, parent, *children;
+        unsigned int count;
+
+        if(!XQueryTree(context->display, window, &root, &parent, &children, &count))
+            break;
+
+        if(children != NULL)
+            XFree(children);
+
+        window = parent;
+    }
+
+    return context->windowClass;
+}
+
+// Make room for the characters of a string of the given length. Buffers only grow, so most scans allocate nothing.
+int reserveTyped(X11Context *context, int length)
+{
+    if(length <= context->typedCapacity)
         return OK;
+
+    KeySym *symbols = realloc(context->typedSymbols, length * sizeof(KeySym));
+    KeyCode *keycodes = realloc(context->typedKeycodes, length * sizeof(KeyCode));
+    unsigned int *states = realloc(context->typedStates, length * sizeof(unsigned int));
+
+    // Keep whatever was reallocated, so that it is freed on termination.
+    context->typedSymbols = symbols ? symbols : context->typedSymbols;
+    context->typedKeycodes = keycodes ? keycodes : context->typedKeycodes;
+    context->typedStates = states ? states : context->typedStates;
+
+    if(symbols == NULL || keycodes == NULL || states == NULL)
+    {
+        LOG(LOG_ERROR, "  Failed to allocate memory for a string of length %d.", length);
+        return FAILED;
+    }
+
+    context->typedCapacity = length;
+    return OK;
 }
 
-int sendTerminator(int terminatorIndex, Window window)
+// Send a XKeyEvent to the specified window with the given keycode and modifiers.
+int sendKeyEvent(X11Context *context, int press, KeyCode keycode, unsigned int state, Window window)
 {
     XKeyEvent event;
 
-    event.display = X11Display;
+    event.display = context->display;
     event.window = window;
-    event.root = rootWindow;
+    event.root = context->rootWindow;
     event.subwindow = None;
     event.time = CurrentTime;
     event.x = 1;
@@ -164,18 +676,26 @@ int sendTerminator(int terminatorIndex, Window window)
     event.x_root = 1;
     event.y_root = 1;
     event.same_screen = TRUE;
-    event.keycode = XKeysymToKeycode(X11Display, terminatorSymbols[terminatorIndex]);
-    event.state = 0;
-    event.type = KeyPress;
+    event.keycode = keycode;
+    event.state = state;
+    event.type = press ? KeyPress : KeyRelease;
 
-    // Send keypress.
-    if(XSendEvent(X11Display, window, TRUE, KeyPressMask, (XEvent *) &event) == 0)
-        return FAILED;
-    
-    // Send keyrelease.
-    event.type = KeyRelease;
-    if(XSendEvent(X11Display, window, TRUE, KeyPressMask, (XEvent *) &event) == 0)
+    if(XSendEvent(context->display, window, TRUE, KeyPressMask, (XEvent *) &event) == 0)
         return FAILED;
+    else
+        return OK;
+}
+
+// Send the pre-encoded terminator events to the specified window.
+int sendTerminator(X11Context *context, Window window)
+{
+    for(int i = 0; i < context->terminatorEventCount; ++i)
+    {
+        context->terminatorEvents[i].window = window;
+
+        if(XSendEvent(context->display, window, TRUE, KeyPressMask, (XEvent *) &context->terminatorEvents[i]) == 0)
+            return FAILED;
+    }
 
     return OK;
 }
@@ -183,24 +703,63 @@ int sendTerminator(int terminatorIndex, Window window)
 // Handles errors reported by X11.
 // Errors can be non-fatal so the function can return but it must not generate
 // (in)directly protocol requests on the display that caused the error.
-// TODO: Actually do something
+// Xlib reports errors in the thread that reads them, which is the one using the display: they are counted
+// in its context, so that typeNow can tell whether its keystrokes were accepted.
 int errorHandler(Display *display, XErrorEvent *error)
 {
     LOG(LOG_ERROR, "Exception raised by X11 server!");
 
+    if(threadContext != NULL && threadContext->display == display)
+        threadContext->errors++;
+
+    // Return value is ignored.
+    return OK;
+}
+
+// Handles the loss of the connection to the X server (server restarted, user logged out...).
+// No request can be made on the display from here.
+int ioErrorHandler(Display *display)
+{
+    LOG(LOG_ERROR, "Connection to the X server %s broken!", DisplayString(display));
+
     // Return value is ignored.
     return OK;
 }
 
+// Called by Xlib after ioErrorHandler with the context of the display. Just take note, X11Poll will reconnect.
+// Returning from here (instead of exiting, the default) keeps the program alive.
+void ioErrorExitHandler(Display *display, void *data)
+{
+    X11Context *context = data;
+
+    context->lost = TRUE;
+}
+
 // Close the display. 
-int X11Terminate()
+int X11Terminate(X11Context *context)
 {
     LOG(LOG_INFO, "Terminating X11 interface...");
-    XCloseDisplay(X11Display);
+    X11Disconnect(context);
+
+    free(context->typedSymbols);
+    free(context->typedKeycodes);
+    free(context->typedStates);
+
+    context->typedSymbols = NULL;
+    context->typedKeycodes = NULL;
+    context->typedStates = NULL;
+    context->typedCapacity = 0;
+
+    if(context->queuedCount > 0)
+        LOG(LOG_WARNING, "  %d scans were never typed.", context->queuedCount);
+
+    for(; context->queuedCount > 0; context->queuedCount--, context->queuedHead = (context->queuedHead + 1) % X11_QUEUE_SIZE)
+        free(context->queuedScans[context->queuedHead]);
+
     LOG(LOG_INFO, "Terminated X11 interface!");
 
-    X11InitializationDirty = FALSE;
-    X11InitializationComplete = FALSE;
+    context->initializationDirty = FALSE;
+    context->initializationComplete = FALSE;
 
     return OK;
 }
\ No newline at end of file
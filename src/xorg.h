@@ -1,5 +1,66 @@
 #pragma once
 
-int X11Initialize();
-int typeString(char *string, int delaySeconds, int terminatorIndex);
-void X11Terminate();
\ No newline at end of file
+#include <X11/Xlib.h>
+#include <time.h>
+
+#include "keymap.h"
+#include "pacing.h"
+#include "routing.h"
+#include "settings.h"
+
+// Scans kept while the display is not available, and milliseconds between two connection attempts.
+#define X11_QUEUE_SIZE 64
+#define X11_RETRY_INTERVAL 1000
+
+// Everything needed to type into one display. Every context must only be used by one thread at a time.
+typedef struct
+{
+    char *displayName;                                  // As passed to XOpenDisplay (NULL for $DISPLAY)
+    Display *display;
+    Window rootWindow;
+
+    int lost;                                           // The connection broke: the display must be closed and reopened.
+    unsigned long errors;                               // Requests the server rejected (see errorHandler).
+    struct timespec lastConnectionAttempt;
+
+    char *queuedScans[X11_QUEUE_SIZE];                  // Scans received while the display was not available.
+    int queuedHead;
+    int queuedCount;
+
+    const Settings *settings;                           // Settings to type with, pinned by the thread using the context.
+
+    XKeyEvent terminatorEvents[TERMINATOR_MAX_KEYS * 2];// Terminator macro encoded for this display...
+    int terminatorEventCount;
+    unsigned long terminatorGeneration;                 // ...from these settings (0 if not encoded yet).
+
+    KeySym *typedSymbols;                               // Characters of the string being typed...
+    KeyCode *typedKeycodes;                             // ...the keycodes typing them...
+    unsigned int *typedStates;                          // ...and the modifiers to hold.
+    int typedCapacity;
+    int typingBlock;                                    // Tabs and newlines are keys (see typeBlock).
+
+    Keymap keymap;
+    WindowIndex windowIndex;                            // Windows scans can be routed to.
+    Pacing pacing;
+
+    Window classWindow;                                 // Last window whose WM_CLASS was looked up...
+    char windowClass[64];                               // ...and its class.
+
+    Window pingFocus;                                   // Last window whose application was looked up...
+    Window pingWindow;                                  // ...and its client window if it answers _NET_WM_PING (None if not).
+    int pingTimedOut;                                   // The application did not answer: XSync for the rest of the scan.
+    long pingSerial;                                    // Tells the answer to the last ping from older ones.
+    int rootSelected;                                   // Answers are sent to the root window: we listen there.
+    Atom wmProtocols;
+    Atom netWmPing;
+
+    int initializationComplete;
+    int initializationDirty;
+} X11Context;
+
+int X11Initialize(X11Context *context, char *displayName);
+int X11Connected(X11Context *context);
+void X11Poll(X11Context *context);
+int typeString(X11Context *context, char *string, int delaySeconds);
+int typeBlock(X11Context *context, char *block);
+int X11Terminate(X11Context *context);
\ No newline at end of file